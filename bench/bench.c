@@ -0,0 +1,467 @@
+/*
+   This file is part of the 'term_pa_spectrum' program, which follows
+   a pulseaudio stream and displays its frequency spectrum through the
+   terminal.
+
+   Copyright (C) <2018> Jose Maria Perez Ramos
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.    See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.    If not, see <http://www.gnu.org/licenses/>.
+
+   Author: Jose Maria Perez Ramos <jose.m.perez.ramos+git gmail>
+   Date: 2018.08.13
+   Version: 1.0.0
+*/
+
+// Microbenchmarks of the DSP and output stages on synthetic spectra.
+// Every result is a line "<stage>\t<config>\t<ns/frame>\t<bytes/frame>",
+// which is also the baseline file format
+
+#include "fft.h"
+#include "output.h"
+#include "output_internal.h"
+
+#include <fcntl.h>
+#include <getopt.h>
+#include <locale.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <tgmath.h> // log in the precision of real_t
+#include <time.h>
+#include <unistd.h>
+#include <wchar.h>
+
+#define BENCH_SPECTRA     16U    // Different frames, cycled, so smoothing and levels move
+#define BENCH_SAMPLE_RATE 44100
+#define BENCH_MAX_RESULTS 4096U
+
+typedef struct {
+    char key[128];               // stage + config
+    double ns;
+    double bytes;
+} bench_result;
+
+typedef struct {
+    double min_ms;               // Time measured per result
+    bench_result* results;
+    unsigned int n_results;
+    bench_result* baseline;
+    unsigned int n_baseline;
+    double threshold;            // Max slowdown ratio before it's a regression
+    unsigned int regressions;
+} bench_state;
+
+typedef struct {char* s; int v;} var;
+static var charsets[] = {
+    {.s = "bars", .v = OUTPUT_CHARSET_BARS},
+    {.s = "braille", .v = OUTPUT_CHARSET_BRAILLE},
+    {.s = "wide_braille", .v = OUTPUT_CHARSET_BRAILLE_WIDE},
+};
+// Grouping and its function, ungrouped max still clamps while none copies
+static struct {char* s; int grouping; int group_func;} groupings[] = {
+    {.s = "none/none",  .grouping = OUTPUT_NO_GROUPING,         .group_func = OUTPUT_NO_GROUPING_FUNC},
+    {.s = "none/max",   .grouping = OUTPUT_NO_GROUPING,         .group_func = OUTPUT_MAX_GROUPING_FUNC},
+    {.s = "lineal/max", .grouping = OUTPUT_LINEAL_GROUPING,     .group_func = OUTPUT_MAX_GROUPING_FUNC},
+    {.s = "lineal/avg", .grouping = OUTPUT_LINEAL_GROUPING,     .group_func = OUTPUT_AVG_GROUPING_FUNC},
+    {.s = "log/max",    .grouping = OUTPUT_LOGARITMIC_GROUPING, .group_func = OUTPUT_MAX_GROUPING_FUNC},
+    {.s = "log/avg",    .grouping = OUTPUT_LOGARITMIC_GROUPING, .group_func = OUTPUT_AVG_GROUPING_FUNC},
+};
+static unsigned int sweep_n_samples[] = {512, 1024, 2048, 4096};
+static unsigned int sweep_num_points[] = {30, 80, 200};
+
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static unsigned int xorshift(unsigned int* state) {
+    *state ^= *state << 13;
+    *state ^= *state >> 17;
+    *state ^= *state << 5;
+    return *state;
+}
+
+// Pink-ish noise plus a few moving peaks, in the magnitude range of S16 input
+static void synthetic_spectra(real_t* spectra, unsigned int n_out_values) {
+    unsigned int seed = 0x12345678;
+    for (unsigned int s = 0; s < BENCH_SPECTRA; ++s) {
+        real_t* spectrum = spectra + s * n_out_values;
+        for (unsigned int i = 0; i < n_out_values; ++i) {
+            real_t noise = (xorshift(&seed) & 0xFFFF) / 65536.0;
+            spectrum[i] = 1 + 2e5 * noise / (1 + i);
+        }
+        for (unsigned int p = 1; p <= 4; ++p) {
+            spectrum[(p * n_out_values / 6 + s * p) % n_out_values] += 1e6 / p;
+        }
+    }
+}
+
+static void synthetic_samples(real_t* samples, unsigned int n_samples) {
+    unsigned int seed = 0x87654321;
+    for (unsigned int i = 0; i < n_samples; ++i) {
+        samples[i] = 8000 * sin(2 * M_PI * 440 * i / BENCH_SAMPLE_RATE) + (int) (xorshift(&seed) & 0x3FF) - 512;
+    }
+}
+
+static void report(bench_state* state, const char* stage, const char* config, double ns, double bytes) {
+    if (state->n_results == BENCH_MAX_RESULTS) {
+        return;
+    }
+    bench_result* result = &state->results[state->n_results++];
+    snprintf(result->key, sizeof result->key, "%s\t%s", stage, config);
+    result->ns = ns;
+    result->bytes = bytes;
+
+    printf("%s\t%.1f\t%.1f", result->key, ns, bytes);
+    for (unsigned int i = 0; i < state->n_baseline; ++i) {
+        if (strcmp(state->baseline[i].key, result->key) == 0) {
+            double ratio = ns / state->baseline[i].ns;
+            int regression = ratio > state->threshold;
+            state->regressions += regression;
+            printf("\t%.2fx%s", ratio, regression ? "\tREGRESSION" : "");
+            break;
+        }
+    }
+    printf("\n");
+}
+
+
+// Runs body until min_ms is reached, doubling the iterations, and leaves
+// in ns the time per iteration
+#define BENCH_LOOP(state, ns, body) \
+    do { \
+        for (unsigned long iterations = 16;; iterations *= 2) { \
+            double start = now_ns(); \
+            for (unsigned long it = 0; it < iterations; ++it) { \
+                body; \
+            } \
+            double elapsed = now_ns() - start; \
+            if (elapsed >= (state)->min_ms * 1e6) { \
+                ns = elapsed / iterations; \
+                break; \
+            } \
+        } \
+    } while (0)
+
+static void bench_fft(bench_state* state, unsigned int n_samples) {
+    real_t* in = (real_t*) FFTW(malloc)(sizeof(real_t) * n_samples);
+    fft_complex* out = (fft_complex*) FFTW(malloc)(sizeof(fft_complex) * (n_samples/2 +1));
+    real_t* magnitudes = (real_t*) malloc(sizeof(real_t) * (n_samples/2 +1));
+    // Same plan as the live pipeline (executed on a moving window)
+    fft_plan plan = fft_plan_r2c(n_samples, in, out, FFT_RIGOR_MEASURE, FFTW_UNALIGNED | FFTW_PRESERVE_INPUT);
+    synthetic_samples(in, n_samples);
+
+    char config[64];
+    double ns;
+    snprintf(config, sizeof config, "n=%u", n_samples);
+    BENCH_LOOP(state, ns, {
+            FFTW(execute_dft_r2c)(plan, in, out);
+            fft_magnitude(out, magnitudes, n_samples/2 +1, 1);
+            });
+    report(state, "fft+magnitude", config, ns, 0);
+
+    // Log mode, on the same spectrum: magnitude then log, and fused
+    BENCH_LOOP(state, ns, {
+            fft_magnitude(out, magnitudes, n_samples/2 +1, 1);
+            for (unsigned int i = 0; i < n_samples/2 +1; ++i) {
+                magnitudes[i] = log(magnitudes[i]);
+            }
+            });
+    report(state, "magnitude+log", config, ns, 0);
+    BENCH_LOOP(state, ns, fft_log_magnitude(out, magnitudes, n_samples/2 +1, 1));
+    report(state, "log_magnitude", config, ns, 0);
+
+    FFTW(destroy_plan)(plan);
+    free(magnitudes);
+    FFTW(free)(out);
+    FFTW(free)(in);
+}
+
+static void bench_output(bench_state* state, unsigned int n_samples, unsigned int num_points, unsigned int charset, unsigned int grouping, unsigned int transform_flags, int sigmoid) {
+    unsigned int n_out_values = n_samples/2 +1;
+    double* frequencies = (double*) malloc(sizeof(double) * n_out_values);
+    for (unsigned int i = 0; i < n_out_values; ++i) {
+        frequencies[i] = (double) BENCH_SAMPLE_RATE / n_samples * i;
+    }
+
+    output_context* out_ctx = output_init(n_out_values, frequencies, 200, 2000, num_points, 0, 100000000,
+            groupings[grouping].grouping, groupings[grouping].group_func, transform_flags);
+    output_set_smoothing(out_ctx, OUTPUT_EXP2_SMOOTH);
+    output_set_smoothing_factors(out_ctx, .25, .2);
+    output_set_lineal_scale_factor_offset(out_ctx, .8);
+    if (sigmoid) {
+        output_set_sigmoid_scale_factor(out_ctx, 10);
+    }
+    output_set_charset(out_ctx, charsets[charset].v);
+
+    real_t* spectra = (real_t*) malloc(sizeof(real_t) * n_out_values * BENCH_SPECTRA);
+    real_t* transformed = (real_t*) malloc(sizeof(real_t) * n_out_values * BENCH_SPECTRA);
+    real_t* values = (real_t*) malloc(sizeof(real_t) * n_out_values);
+    char* line = malloc(output_line_max_length(out_ctx));
+    synthetic_spectra(spectra, n_out_values);
+    memcpy(transformed, spectra, sizeof(real_t) * n_out_values * BENCH_SPECTRA);
+    for (unsigned int s = 0; s < BENCH_SPECTRA; ++s) {
+        transform(out_ctx, transformed + s * n_out_values);
+    }
+
+    char config[96];
+    snprintf(config, sizeof config, "n=%u b=%u c=%s g=%s t=%s i=%s", n_samples, num_points, charsets[charset].s,
+            groupings[grouping].s, transform_flags ? "log" : "none", sigmoid ? "on" : "off");
+
+    // transform works in place, the copy is measured and discounted
+    double copy_ns, ns;
+    unsigned int s = 0;
+    BENCH_LOOP(state, copy_ns, {
+            memcpy(values, spectra + (s++ % BENCH_SPECTRA) * n_out_values, sizeof(real_t) * n_out_values);
+            __asm__ volatile("" : : "r"(values) : "memory");
+            });
+    BENCH_LOOP(state, ns, {
+            memcpy(values, spectra + (s++ % BENCH_SPECTRA) * n_out_values, sizeof(real_t) * n_out_values);
+            transform(out_ctx, values);
+            });
+    report(state, "transform", config, ns > copy_ns ? ns - copy_ns : 0, 0);
+
+    BENCH_LOOP(state, ns, accumulate(out_ctx, transformed + (s++ % BENCH_SPECTRA) * n_out_values));
+    report(state, "accumulate", config, ns, 0);
+    double accumulate_ns = ns; // smooth needs a new accumulation to be meaningful
+
+    real_t* output_buffer;
+    real_t min, max;
+    BENCH_LOOP(state, ns, {
+            accumulate(out_ctx, transformed + (s++ % BENCH_SPECTRA) * n_out_values);
+            smooth(out_ctx, &output_buffer, &min, &max);
+            });
+    report(state, "smooth", config, ns > accumulate_ns ? ns - accumulate_ns : 0, 0);
+
+    size_t bytes = 0;
+    unsigned long frames = 0;
+    BENCH_LOOP(state, ns, {
+            bytes += output_render(out_ctx, line);
+            frames++;
+            });
+    report(state, "render", config, ns, (double) bytes / frames);
+
+    bytes = 0;
+    frames = 0;
+    BENCH_LOOP(state, ns, {
+            memcpy(values, spectra + (s++ % BENCH_SPECTRA) * n_out_values, sizeof(real_t) * n_out_values);
+            bytes += output_print(out_ctx, values, line);
+            frames++;
+            });
+    report(state, "output_print", config, ns > copy_ns ? ns - copy_ns : 0, (double) bytes / frames);
+
+    free(line);
+    free(values);
+    free(transformed);
+    free(spectra);
+    output_deinit(out_ctx);
+    free(frequencies);
+}
+
+
+// Getting a rendered line to the terminal (/dev/null here), the same frames
+// both ways: as wide chars through stdio, converted by the locale on every
+// frame (before the glyphs were pre-encoded), and as UTF-8 with one write(2)
+static void bench_emit(bench_state* state, unsigned int num_points, unsigned int charset) {
+    unsigned int n_samples = sweep_n_samples[1];
+    unsigned int n_out_values = n_samples/2 +1;
+    double* frequencies = (double*) malloc(sizeof(double) * n_out_values);
+    for (unsigned int i = 0; i < n_out_values; ++i) {
+        frequencies[i] = (double) BENCH_SAMPLE_RATE / n_samples * i;
+    }
+    output_context* out_ctx = output_init(n_out_values, frequencies, 200, 2000, num_points, 0, 100000000,
+            OUTPUT_LOGARITMIC_GROUPING, OUTPUT_MAX_GROUPING_FUNC, OUTPUT_LOGARITMIC_TRANSFORM);
+    output_set_smoothing(out_ctx, OUTPUT_EXP2_SMOOTH);
+    output_set_charset(out_ctx, charsets[charset].v);
+
+    size_t line_max_length = output_line_max_length(out_ctx);
+    real_t* spectra = (real_t*) malloc(sizeof(real_t) * n_out_values * BENCH_SPECTRA);
+    char* frames = (char*) malloc((1 + line_max_length) * BENCH_SPECTRA);
+    size_t lengths[BENCH_SPECTRA];
+    wchar_t* wide_lines = (wchar_t*) malloc(sizeof(wchar_t) * (line_max_length + 1) * BENCH_SPECTRA);
+    synthetic_spectra(spectra, n_out_values);
+    for (unsigned int s = 0; s < BENCH_SPECTRA; ++s) {
+        char* frame = frames + s * (1 + line_max_length);
+        frame[0] = '\r';
+        lengths[s] = 1 + output_print(out_ctx, spectra + s * n_out_values, frame + 1);
+
+        char* line = strndup(frame + 1, lengths[s] - 1);
+        mbstowcs(wide_lines + s * (line_max_length + 1), line, line_max_length + 1);
+        free(line);
+    }
+
+    FILE* file = fopen("/dev/null", "w");
+    int fd = open("/dev/null", O_WRONLY);
+    if (file && fd >= 0) {
+        char config[96];
+        snprintf(config, sizeof config, "b=%u c=%s", num_points, charsets[charset].s);
+
+        double ns;
+        size_t bytes = 0;
+        unsigned long n_frames = 0;
+        unsigned int s = 0;
+        BENCH_LOOP(state, ns, {
+                bytes += fprintf(file, "%c%ls", '\r', wide_lines + (s++ % BENCH_SPECTRA) * (line_max_length + 1));
+                fflush(file);
+                n_frames++;
+                });
+        report(state, "emit_stdio_wide", config, ns, (double) bytes / n_frames);
+
+        bytes = 0;
+        n_frames = 0;
+        BENCH_LOOP(state, ns, {
+                unsigned int frame = s++ % BENCH_SPECTRA;
+                bytes += write(fd, frames + frame * (1 + line_max_length), lengths[frame]);
+                n_frames++;
+                });
+        report(state, "emit_write_utf8", config, ns, (double) bytes / n_frames);
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    if (file) {
+        fclose(file);
+    }
+
+    free(wide_lines);
+    free(frames);
+    free(spectra);
+    output_deinit(out_ctx);
+    free(frequencies);
+}
+
+
+static unsigned int load_results(const char* path, bench_result* results) {
+    FILE* file = fopen(path, "r");
+    if (!file) {
+        fprintf(stderr, "Bench: Cannot read baseline %s\n", path);
+        exit(1);
+    }
+
+    char line[256];
+    unsigned int n = 0;
+    while (n < BENCH_MAX_RESULTS && fgets(line, sizeof line, file)) {
+        // stage \t config \t ns \t bytes
+        char* fields[4];
+        unsigned int n_fields = 0;
+        for (char* field = strtok(line, "\t\n"); field && n_fields < 4; field = strtok(NULL, "\t\n")) {
+            fields[n_fields++] = field;
+        }
+        if (n_fields == 4) {
+            snprintf(results[n].key, sizeof results[n].key, "%s\t%s", fields[0], fields[1]);
+            results[n].ns = atof(fields[2]);
+            results[n].bytes = atof(fields[3]);
+            n++;
+        }
+    }
+    fclose(file);
+    return n;
+}
+
+static void store_results(const char* path, bench_state* state) {
+    FILE* file = fopen(path, "w");
+    if (!file) {
+        fprintf(stderr, "Bench: Cannot write baseline %s\n", path);
+        exit(1);
+    }
+    for (unsigned int i = 0; i < state->n_results; ++i) {
+        fprintf(file, "%s\t%.1f\t%.1f\n", state->results[i].key, state->results[i].ns, state->results[i].bytes);
+    }
+    fclose(file);
+}
+
+int main(int argc, char** argv) {
+    bench_state state = {
+        .min_ms = 10,
+        .threshold = 1.15,
+        .results = calloc(BENCH_MAX_RESULTS, sizeof(bench_result)),
+    };
+    const char* write_path = NULL;
+    int quick = 0;
+
+    int c;
+    while ((c = getopt(argc, argv, "t:w:c:x:qh")) != -1) {
+        switch (c) {
+            case 't':
+                state.min_ms = atof(optarg);
+                break;
+            case 'w':
+                write_path = optarg;
+                break;
+            case 'c':
+                state.baseline = calloc(BENCH_MAX_RESULTS, sizeof(bench_result));
+                state.n_baseline = load_results(optarg, state.baseline);
+                break;
+            case 'x':
+                state.threshold = atof(optarg);
+                break;
+            case 'q':
+                quick = 1;
+                break;
+            case 'h':
+            default:
+                fprintf(stderr, "Available options:\n");
+                fprintf(stderr, "-t <%.0f>: Minimum ms measured per result\n", state.min_ms);
+                fprintf(stderr, "-w <file>: Store the results as baseline\n");
+                fprintf(stderr, "-c <file>: Compare against a baseline, exit status is 1 if there are regressions\n");
+                fprintf(stderr, "-x <%.2f>: Slowdown ratio considered a regression\n", state.threshold);
+                fprintf(stderr, "-q: Quick, only n=1024 and 30 columns\n");
+                return c != 'h';
+        }
+    }
+    setlocale(LC_ALL, "");
+    if (MB_CUR_MAX == 1) {
+        setlocale(LC_CTYPE, "C.UTF-8"); // The wide chars path needs a UTF-8 locale, like a terminal
+    }
+
+    unsigned int n_sizes = quick ? 1 : sizeof sweep_n_samples / sizeof *sweep_n_samples;
+    unsigned int n_widths = quick ? 1 : sizeof sweep_num_points / sizeof *sweep_num_points;
+    unsigned int* sizes = quick ? &sweep_n_samples[1] : sweep_n_samples;
+
+    printf("# stage\tconfig\tns/frame\tbytes/frame%s\n", state.n_baseline ? "\tratio" : "");
+    for (unsigned int n = 0; n < n_sizes; ++n) {
+        bench_fft(&state, sizes[n]);
+    }
+    for (unsigned int n = 0; n < n_sizes; ++n) {
+        for (unsigned int b = 0; b < n_widths; ++b) {
+            for (unsigned int charset = 0; charset < sizeof charsets / sizeof *charsets; ++charset) {
+                for (unsigned int grouping = 0; grouping < sizeof groupings / sizeof *groupings; ++grouping) {
+                    for (unsigned int transform_flags = 0; transform_flags <= OUTPUT_LOGARITMIC_TRANSFORM; ++transform_flags) {
+                        for (int sigmoid = 0; sigmoid <= 1; ++sigmoid) {
+                            bench_output(&state, sizes[n], sweep_num_points[b], charset, grouping, transform_flags, sigmoid);
+                        }
+                    }
+                }
+            }
+        }
+    }
+    for (unsigned int b = 0; b < n_widths; ++b) {
+        for (unsigned int charset = 0; charset < sizeof charsets / sizeof *charsets; ++charset) {
+            bench_emit(&state, sweep_num_points[b], charset);
+        }
+    }
+
+    if (write_path) {
+        store_results(write_path, &state);
+    }
+    if (state.n_baseline) {
+        fprintf(stderr, "Bench: %u regressions (>%.2fx) against %u baseline results\n", state.regressions, state.threshold, state.n_baseline);
+    }
+
+    free(state.baseline);
+    free(state.results);
+    return state.regressions ? 1 : 0;
+}
@@ -0,0 +1,128 @@
+/*
+   This file is part of the 'term_pa_spectrum' program, which follows
+   a pulseaudio stream and displays its frequency spectrum through the
+   terminal.
+
+   Copyright (C) <2018> Jose Maria Perez Ramos
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.    See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.    If not, see <http://www.gnu.org/licenses/>.
+
+   Author: Jose Maria Perez Ramos <jose.m.perez.ramos+git gmail>
+   Date: 2018.08.13
+   Version: 1.0.0
+*/
+
+#include "decimator.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define DECIMATOR_BLOCK 256U            // Input samples copied to the delay line at once
+#define DECIMATOR_TAPS_PER_FACTOR 28U   // Blackman, transition 0.4 -> 0.6 of the output rate
+
+struct decimator {
+    unsigned int factor;
+    unsigned int taps;
+    real_t* coefficients;               // Symmetric, so no need to reverse them
+    real_t* delay;                      // taps-1 previous samples + a block
+    unsigned int phase;                 // Input samples since the last output
+};
+
+decimator* decimator_init(unsigned int factor) {
+    decimator* dec = NULL;
+    if ((dec = malloc(sizeof *dec))) {
+        unsigned int taps = DECIMATOR_TAPS_PER_FACTOR * factor + 1;
+        *dec = (decimator) {
+            .factor = factor,
+            .taps = taps,
+            .coefficients = malloc(taps * sizeof(real_t)),
+            .delay = malloc((taps - 1 + DECIMATOR_BLOCK) * sizeof(real_t)),
+        };
+        if (!dec->coefficients || !dec->delay) {
+            decimator_deinit(dec);
+            return NULL;
+        }
+
+        // Blackman windowed sinc, cutoff at the output Nyquist, unity DC gain
+        double cutoff = 0.5 / factor;
+        double sum = 0;
+        for (unsigned int k = 0; k < taps; ++k) {
+            double t = k - (taps - 1) / 2.0;
+            double sinc = t ? sin(2 * M_PI * cutoff * t) / (M_PI * t) : 2 * cutoff;
+            double window = 0.42 - 0.5 * cos(2 * M_PI * k / (taps - 1)) + 0.08 * cos(4 * M_PI * k / (taps - 1));
+            dec->coefficients[k] = sinc * window;
+            sum += dec->coefficients[k];
+        }
+        for (unsigned int k = 0; k < taps; ++k) {
+            dec->coefficients[k] /= sum;
+        }
+        decimator_reset(dec);
+    }
+    return dec;
+}
+
+void decimator_deinit(decimator* dec) {
+    free(dec->delay);
+    free(dec->coefficients);
+    free(dec);
+}
+
+unsigned int decimator_factor_for(unsigned int sample_rate, unsigned int max_freq) {
+    unsigned int factor = max_freq ? (unsigned int) (0.4 * sample_rate / max_freq) : 1;
+    return factor ? factor : 1;
+}
+
+unsigned int decimator_input_needed(decimator* dec, unsigned int n_outputs) {
+    return n_outputs ? n_outputs * dec->factor - dec->phase : 0;
+}
+
+unsigned int decimator_delay(decimator* dec) {
+    return (dec->taps - 1) / 2; // Linear phase
+}
+
+unsigned int decimator_process(decimator* dec, const real_t* in, unsigned int in_stride, unsigned int length, real_t* out) {
+    unsigned int history = dec->taps - 1;
+    unsigned int produced = 0;
+
+    while (length) {
+        unsigned int block = (length < DECIMATOR_BLOCK) ? length : DECIMATOR_BLOCK;
+        real_t* newest = dec->delay + history;
+        for (unsigned int i = 0; i < block; ++i) {
+            newest[i] = in[i * in_stride];
+        }
+
+        // Output when the phase completes, its newest sample is newest[i]
+        for (unsigned int i = dec->factor - 1 - dec->phase; i < block; i += dec->factor) {
+            const real_t* x = dec->delay + i;
+            real_t acc = 0;
+            for (unsigned int k = 0; k < dec->taps; ++k) {
+                acc += dec->coefficients[k] * x[k];
+            }
+            out[produced++] = acc;
+        }
+        dec->phase = (dec->phase + block) % dec->factor;
+
+        memmove(dec->delay, dec->delay + block, history * sizeof(real_t));
+        in += block * in_stride;
+        length -= block;
+    }
+
+    return produced;
+}
+
+void decimator_reset(decimator* dec) {
+    memset(dec->delay, 0, (dec->taps - 1 + DECIMATOR_BLOCK) * sizeof(real_t));
+    dec->phase = 0;
+}
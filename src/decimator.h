@@ -0,0 +1,32 @@
+#ifndef DECIMATOR_H
+#define DECIMATOR_H
+
+#include "precision.h"
+
+// Anti-aliasing FIR low pass + downsampling by an integer factor, only the
+// kept outputs are computed (polyphase). Cutoff is the output Nyquist: the
+// band that aliases is the transition band, which folds over the top 20% of
+// the output band, so only frequencies up to 0.4 * output rate are clean
+
+typedef struct decimator decimator;
+
+decimator* decimator_init(unsigned int factor);
+
+void decimator_deinit(decimator* dec);
+
+// Biggest factor that keeps max_freq clean
+unsigned int decimator_factor_for(unsigned int sample_rate, unsigned int max_freq);
+
+// Input samples that produce exactly n_outputs outputs
+unsigned int decimator_input_needed(decimator* dec, unsigned int n_outputs);
+
+// Group delay of the filter, in input samples
+unsigned int decimator_delay(decimator* dec);
+
+// Reads length samples, in_stride apart (i.e. one channel of interleaved
+// frames), returns how many outputs were written
+unsigned int decimator_process(decimator* dec, const real_t* in, unsigned int in_stride, unsigned int length, real_t* out);
+
+void decimator_reset(decimator* dec);
+
+#endif
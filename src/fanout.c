@@ -0,0 +1,251 @@
+/*
+   This file is part of the 'term_pa_spectrum' program, which follows
+   a pulseaudio stream and displays its frequency spectrum through the
+   terminal.
+
+   Copyright (C) <2018> Jose Maria Perez Ramos
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.    See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.    If not, see <http://www.gnu.org/licenses/>.
+
+   Author: Jose Maria Perez Ramos <jose.m.perez.ramos+git gmail>
+   Date: 2018.08.13
+   Version: 1.0.0
+*/
+
+#define _GNU_SOURCE // accept4
+
+#include "fanout.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// A few frames of slack, then a stalled client starts dropping instead of
+// catching up later on stale frames. The largest message is about the
+// (doubled by the kernel) buffer, any frame has to fit
+#define FANOUT_SNDBUF (2 * FANOUT_MAX_FRAME)
+
+typedef struct {
+    int fd;
+    void* served;
+} fanout_client;
+
+struct fanout {
+    int listen_fd;
+    int epoll_fd;                  // Listening socket and clients
+    struct sockaddr_un address;
+    fanout_client* clients;
+    unsigned int n_clients;
+    unsigned int max_clients;
+    fanout_request_cb request;
+    fanout_release_cb release;
+    void* userdata;
+};
+
+static int fill_address(struct sockaddr_un* address, const char* path) {
+    memset(address, 0, sizeof *address);
+    address->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof address->sun_path) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(address->sun_path, path);
+    return 0;
+}
+
+// Only replaces the socket file if nobody is listening there
+static int bind_replacing_stale(int fd, const struct sockaddr_un* address) {
+    if (bind(fd, (const struct sockaddr*) address, sizeof *address) == 0) {
+        return 0;
+    }
+    if (errno != EADDRINUSE) {
+        return -1;
+    }
+    int probe = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    int alive = probe >= 0 && connect(probe, (const struct sockaddr*) address, sizeof *address) == 0;
+    if (probe >= 0) {
+        close(probe);
+    }
+    if (alive) {
+        errno = EADDRINUSE;
+        return -1;
+    }
+    unlink(address->sun_path);
+    return bind(fd, (const struct sockaddr*) address, sizeof *address);
+}
+
+fanout* fanout_init(const char* path, unsigned int max_clients, fanout_request_cb request, fanout_release_cb release, void* userdata) {
+    fanout* f = (fanout*) calloc(1, sizeof(fanout));
+    if (!f || !(f->clients = (fanout_client*) malloc(sizeof(fanout_client) * max_clients))) {
+        fprintf(stderr, "Fanout: Cannot allocate %u clients\n", max_clients);
+        free(f);
+        return NULL;
+    }
+    f->listen_fd = f->epoll_fd = -1;
+    f->max_clients = max_clients;
+    f->request = request;
+    f->release = release;
+    f->userdata = userdata;
+
+    struct epoll_event event = {.events = EPOLLIN};
+    if (fill_address(&f->address, path) < 0
+            || (f->listen_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0
+            || bind_replacing_stale(f->listen_fd, &f->address) < 0
+            || listen(f->listen_fd, 16) < 0
+            || (f->epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0
+            || (event.data.fd = f->listen_fd, epoll_ctl(f->epoll_fd, EPOLL_CTL_ADD, f->listen_fd, &event)) < 0) {
+        fprintf(stderr, "Fanout: Cannot listen on %s: %s\n", path, strerror(errno));
+        if (f->listen_fd >= 0) {
+            close(f->listen_fd);
+        }
+        if (f->epoll_fd >= 0) {
+            close(f->epoll_fd);
+        }
+        free(f->clients);
+        free(f);
+        return NULL;
+    }
+
+    return f;
+}
+
+static void remove_client(fanout* f, unsigned int client) {
+    fanout_client* c = f->clients + client;
+    epoll_ctl(f->epoll_fd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    if (c->served) {
+        f->release(f->userdata, c->served);
+    }
+    *c = f->clients[--f->n_clients];
+}
+
+void fanout_deinit(fanout* f) {
+    while (f->n_clients) {
+        remove_client(f, f->n_clients - 1);
+    }
+    close(f->epoll_fd);
+    close(f->listen_fd);
+    unlink(f->address.sun_path);
+    free(f->clients);
+    free(f);
+}
+
+int fanout_fd(fanout* f) {
+    return f->epoll_fd;
+}
+
+static void accept_clients(fanout* f) {
+    int fd;
+    while ((fd = accept4(f->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+        struct epoll_event event = {.events = EPOLLIN, .data.fd = fd};
+        int sndbuf = FANOUT_SNDBUF;
+        if (f->n_clients == f->max_clients || epoll_ctl(f->epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0) {
+            close(fd);
+            continue;
+        }
+        setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof sndbuf);
+        f->clients[f->n_clients++] = (fanout_client) {.fd = fd, .served = NULL};
+    }
+}
+
+static void read_request(fanout* f, unsigned int client) {
+    fanout_client* c = f->clients + client;
+    char request[FANOUT_MAX_REQUEST + 1];
+    // With MSG_TRUNC the whole length is returned, even if it did not fit
+    ssize_t length = recv(c->fd, request, FANOUT_MAX_REQUEST, MSG_TRUNC);
+    if (length < 0 && (errno == EAGAIN || errno == EINTR)) {
+        return;
+    }
+    if (length <= 0) {
+        remove_client(f, client); // Hangup
+        return;
+    }
+
+    char error[256] = FANOUT_ERROR;
+    size_t prefix = strlen(FANOUT_ERROR);
+    void* served = NULL;
+    if (length > FANOUT_MAX_REQUEST) {
+        snprintf(error + prefix, sizeof error - prefix, "request longer than %d bytes", FANOUT_MAX_REQUEST);
+    } else {
+        request[length] = '\0';
+        served = f->request(f->userdata, request, c->served, error + prefix, sizeof error - prefix);
+    }
+    if (!served) {
+        send(c->fd, error, strlen(error), MSG_DONTWAIT | MSG_NOSIGNAL);
+        remove_client(f, client);
+        return;
+    }
+
+    void* previous = c->served;
+    c->served = served;
+    if (previous) {
+        f->release(f->userdata, previous);
+    }
+}
+
+void fanout_handle(fanout* f) {
+    struct epoll_event events[16];
+    int n_events = epoll_wait(f->epoll_fd, events, sizeof events / sizeof events[0], 0);
+    for (int i = 0; i < n_events; ++i) {
+        int fd = events[i].data.fd;
+        if (fd == f->listen_fd) {
+            accept_clients(f);
+            continue;
+        }
+        // Clients move when others are removed, look it up every time
+        for (unsigned int client = 0; client < f->n_clients; ++client) {
+            if (f->clients[client].fd == fd) {
+                read_request(f, client);
+                break;
+            }
+        }
+    }
+}
+
+unsigned int fanout_clients(fanout* f) {
+    return f->n_clients;
+}
+
+void* fanout_served(fanout* f, unsigned int client) {
+    return f->clients[client].served;
+}
+
+void fanout_send(fanout* f, unsigned int client, const void* frame, size_t length) {
+    // EAGAIN drops the frame, the client gets the next one. Other errors
+    // are hangups, handled when epoll reports them
+    send(f->clients[client].fd, frame, length, MSG_DONTWAIT | MSG_NOSIGNAL);
+}
+
+int fanout_connect(const char* path, const char* request) {
+    struct sockaddr_un address;
+    if (fill_address(&address, path) < 0) {
+        return -1;
+    }
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    if (connect(fd, (const struct sockaddr*) &address, sizeof address) < 0 || send(fd, request, strlen(request), MSG_NOSIGNAL) < 0) {
+        int error = errno;
+        close(fd);
+        errno = error;
+        return -1;
+    }
+    return fd;
+}
@@ -0,0 +1,48 @@
+#ifndef FANOUT_H
+#define FANOUT_H
+
+#include <stddef.h>
+
+// Serves frames to the clients of a Unix domain socket (SOCK_SEQPACKET,
+// a message per request or frame, never split nor merged):
+//   client -> server: a request, text up to FANOUT_MAX_REQUEST bytes. It can
+//                     be sent again at any time to replace the previous one
+//   server -> client: frames, up to FANOUT_MAX_FRAME bytes. A rejected
+//                     request gets FANOUT_ERROR and the reason instead, and
+//                     the connection is closed
+// Sending never blocks: a client that does not keep up loses frames, the
+// others are not delayed
+
+#define FANOUT_MAX_REQUEST 1024
+#define FANOUT_MAX_FRAME   8192
+#define FANOUT_ERROR       "error: "
+
+// Returns what the request is served with (opaque), or NULL and the reason
+// to reject it. previous is what the client was served with, if any,
+// released after this call if the request is accepted
+typedef void* (*fanout_request_cb)(void* userdata, const char* request, void* previous, char* error, size_t error_size);
+typedef void (*fanout_release_cb)(void* userdata, void* served);
+
+typedef struct fanout fanout;
+
+// Returns NULL (and prints why) on failure. A stale socket file is replaced
+fanout* fanout_init(const char* path, unsigned int max_clients, fanout_request_cb request, fanout_release_cb release, void* userdata);
+
+// Closes every client and removes the socket file
+void fanout_deinit(fanout* f);
+
+// Readable when there are connections, requests or hangups to handle
+int fanout_fd(fanout* f);
+void fanout_handle(fanout* f);
+
+// Clients, the ones without an accepted request yet are served NULL.
+// Indexes are only stable until the next fanout_handle
+unsigned int fanout_clients(fanout* f);
+void* fanout_served(fanout* f, unsigned int client);
+void fanout_send(fanout* f, unsigned int client, const void* frame, size_t length);
+
+// Client side, connects and sends the request. Returns the socket or -1
+// (errno is set)
+int fanout_connect(const char* path, const char* request);
+
+#endif
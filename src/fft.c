@@ -0,0 +1,263 @@
+/*
+   This file is part of the 'term_pa_spectrum' program, which follows
+   a pulseaudio stream and displays its frequency spectrum through the
+   terminal.
+
+   Copyright (C) <2018> Jose Maria Perez Ramos
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.    See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.    If not, see <http://www.gnu.org/licenses/>.
+
+   Author: Jose Maria Perez Ramos <jose.m.perez.ramos+git gmail>
+   Date: 2018.08.13
+   Version: 1.0.0
+*/
+
+#include "fft.h"
+
+#include <errno.h>
+#include <float.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <tgmath.h>
+
+#ifndef DOUBLE_PRECISION
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__SSE__)
+#include <xmmintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+#endif
+
+static unsigned int rigor_flags[] = {
+    [FFT_RIGOR_ESTIMATE] = FFTW_ESTIMATE,
+    [FFT_RIGOR_MEASURE] = FFTW_MEASURE,
+    [FFT_RIGOR_PATIENT] = FFTW_PATIENT,
+    [FFT_RIGOR_EXHAUSTIVE] = FFTW_EXHAUSTIVE,
+};
+
+// Fills path with the wisdom file name, creating its directory if needed.
+// Returns 0 if there's no place for it
+static int wisdom_path(char* path, size_t path_size, int n_samples, int howmany) {
+    const char* cache_home = getenv("XDG_CACHE_HOME");
+    const char* home = getenv("HOME");
+    int length;
+
+    if (cache_home && cache_home[0]) {
+        length = snprintf(path, path_size, "%s", cache_home);
+    } else if (home && home[0]) {
+        length = snprintf(path, path_size, "%s/.cache", home);
+    } else {
+        return 0;
+    }
+    if (length < 0 || (size_t) length >= path_size) {
+        return 0;
+    }
+    if (mkdir(path, 0700) < 0 && errno != EEXIST) {
+        return 0;
+    }
+
+    length += snprintf(path + length, path_size - length, "/term_pa_spectrum");
+    if ((size_t) length >= path_size || (mkdir(path, 0700) < 0 && errno != EEXIST)) {
+        return 0;
+    }
+
+    length += snprintf(path + length, path_size - length, "/fftw_wisdom_%s_%d", PRECISION_NAME, n_samples);
+    if (howmany > 1 && (size_t) length < path_size) {
+        length += snprintf(path + length, path_size - length, "x%d", howmany);
+    }
+    return (size_t) length < path_size;
+}
+
+fft_plan fft_plan_r2c(int n_samples, real_t* in, fft_complex* out, unsigned int rigor, unsigned int flags) {
+    return fft_plan_r2c_many(n_samples, 1, in, n_samples, out, n_samples/2 +1, rigor, flags);
+}
+
+fft_plan fft_plan_r2c_many(int n_samples, int howmany, real_t* in, int in_distance, fft_complex* out, int out_distance, unsigned int rigor, unsigned int flags) {
+    char path[4096];
+    int has_path = wisdom_path(path, sizeof path, n_samples, howmany);
+    fft_plan plan = NULL;
+
+    if (rigor > FFT_RIGOR_EXHAUSTIVE) {
+        rigor = FFT_RIGOR_MEASURE;
+    }
+    flags |= rigor_flags[rigor];
+
+    if (has_path && FFTW(import_wisdom_from_filename)(path)) {
+        // Wisdom from a stronger rigor is also valid for weaker ones
+        plan = FFTW(plan_many_dft_r2c)(1, &n_samples, howmany, in, NULL, 1, in_distance, out, NULL, 1, out_distance, flags | FFTW_WISDOM_ONLY);
+    }
+
+    if (!plan) {
+        plan = FFTW(plan_many_dft_r2c)(1, &n_samples, howmany, in, NULL, 1, in_distance, out, NULL, 1, out_distance, flags);
+        if (plan && has_path && rigor != FFT_RIGOR_ESTIMATE && !FFTW(export_wisdom_to_filename)(path)) {
+            fprintf(stderr, "FFT: Cannot store wisdom in %s\n", path);
+        }
+    }
+
+    return plan;
+}
+
+void fft_magnitude(const fft_complex* in, real_t* out, unsigned int length, real_t scale) {
+    const real_t* interleaved = (const real_t*) in; // re, im, re, im...
+    unsigned int i = 0;
+
+#ifndef DOUBLE_PRECISION
+#if defined(__AVX2__)
+    const __m256i order = _mm256_setr_epi32(0, 1, 4, 5, 2, 3, 6, 7);
+    const __m256 scale_v = _mm256_set1_ps(scale);
+    for (; i + 8 <= length; i += 8) {
+        __m256 a = _mm256_loadu_ps(interleaved + 2*i);
+        __m256 b = _mm256_loadu_ps(interleaved + 2*i + 8);
+        a = _mm256_mul_ps(a, a);
+        b = _mm256_mul_ps(b, b);
+        // Shuffles work by 128 bit lanes, the permutation restores the order
+        __m256 re2 = _mm256_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0));
+        __m256 im2 = _mm256_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1));
+        __m256 mag = _mm256_mul_ps(_mm256_sqrt_ps(_mm256_add_ps(re2, im2)), scale_v);
+        _mm256_storeu_ps(out + i, _mm256_permutevar8x32_ps(mag, order));
+    }
+#elif defined(__SSE__)
+    const __m128 scale_v = _mm_set1_ps(scale);
+    for (; i + 4 <= length; i += 4) {
+        __m128 a = _mm_loadu_ps(interleaved + 2*i);
+        __m128 b = _mm_loadu_ps(interleaved + 2*i + 4);
+        a = _mm_mul_ps(a, a);
+        b = _mm_mul_ps(b, b);
+        __m128 re2 = _mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0));
+        __m128 im2 = _mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1));
+        _mm_storeu_ps(out + i, _mm_mul_ps(_mm_sqrt_ps(_mm_add_ps(re2, im2)), scale_v));
+    }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    for (; i + 4 <= length; i += 4) {
+        float32x4x2_t c = vld2q_f32(interleaved + 2*i); // Deinterleaves re and im
+        float32x4_t mag2 = vmlaq_f32(vmulq_f32(c.val[0], c.val[0]), c.val[1], c.val[1]);
+        vst1q_f32(out + i, vmulq_n_f32(vsqrtq_f32(mag2), scale));
+    }
+#endif
+#endif
+
+    for (; i < length; ++i) {
+        real_t re = interleaved[2*i];
+        real_t im = interleaved[2*i + 1];
+        out[i] = scale * sqrt(re*re + im*im);
+    }
+}
+
+#ifndef DOUBLE_PRECISION
+// x = m * 2^e with m in [sqrt(1/2), sqrt(2)), then
+// log(m) = 2 * atanh(t) = 2 * (t + t^3/3 + t^5/5 + t^7/7 + ...), t = (m-1)/(m+1)
+// |t| < 0.172, so the first dropped term is below 3e-8
+#define LOG_SQRT_HALF_BITS 0x3F3504F3
+#define LOG_C3 (1.0f/3)
+#define LOG_C5 (1.0f/5)
+#define LOG_C7 (1.0f/7)
+
+// Half the log of a positive power, plus offset
+static inline float half_log_approx(float power, float offset) {
+    uint32_t bits;
+    memcpy(&bits, &power, sizeof bits);
+    int32_t e = ((int32_t) (bits - LOG_SQRT_HALF_BITS)) >> 23;
+    bits -= (uint32_t) e << 23;
+    float m;
+    memcpy(&m, &bits, sizeof m);
+
+    float t = (m - 1) / (m + 1);
+    float t2 = t * t;
+    float p = ((t2 * LOG_C7 + LOG_C5) * t2 + LOG_C3) * t2 + 1;
+    return e * (float) (M_LN2 / 2) + t * p + offset;
+}
+#endif
+
+void fft_log_magnitude(const fft_complex* in, real_t* out, unsigned int length, real_t scale) {
+    const real_t* interleaved = (const real_t*) in; // re, im, re, im...
+    real_t offset = log(scale);
+    unsigned int i = 0;
+
+#ifndef DOUBLE_PRECISION
+#if defined(__SSE2__)
+    const __m128i sqrt_half = _mm_set1_epi32(LOG_SQRT_HALF_BITS);
+    const __m128 one = _mm_set1_ps(1);
+    const __m128 min_normal = _mm_set1_ps(FLT_MIN);
+    const __m128 minus_inf = _mm_set1_ps(-INFINITY);
+    const __m128 half_ln2 = _mm_set1_ps(M_LN2 / 2);
+    const __m128 offset_v = _mm_set1_ps(offset);
+    for (; i + 4 <= length; i += 4) {
+        __m128 a = _mm_loadu_ps(interleaved + 2*i);
+        __m128 b = _mm_loadu_ps(interleaved + 2*i + 4);
+        a = _mm_mul_ps(a, a);
+        b = _mm_mul_ps(b, b);
+        __m128 power = _mm_add_ps(_mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0)), _mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1)));
+
+        __m128i bits = _mm_castps_si128(power);
+        __m128i e = _mm_srai_epi32(_mm_sub_epi32(bits, sqrt_half), 23);
+        __m128 m = _mm_castsi128_ps(_mm_sub_epi32(bits, _mm_slli_epi32(e, 23)));
+        __m128 t = _mm_div_ps(_mm_sub_ps(m, one), _mm_add_ps(m, one));
+        __m128 t2 = _mm_mul_ps(t, t);
+        __m128 p = _mm_add_ps(_mm_mul_ps(t2, _mm_set1_ps(LOG_C7)), _mm_set1_ps(LOG_C5));
+        p = _mm_add_ps(_mm_mul_ps(p, t2), _mm_set1_ps(LOG_C3));
+        p = _mm_add_ps(_mm_mul_ps(p, t2), one);
+        __m128 result = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(e), half_ln2), _mm_mul_ps(t, p)), offset_v);
+
+        // The exponent bits of denormals are not their exponent
+        __m128 is_silence = _mm_cmplt_ps(power, min_normal);
+        _mm_storeu_ps(out + i, _mm_or_ps(_mm_andnot_ps(is_silence, result), _mm_and_ps(is_silence, minus_inf)));
+    }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    const int32x4_t sqrt_half = vdupq_n_s32(LOG_SQRT_HALF_BITS);
+    const float32x4_t one = vdupq_n_f32(1);
+    const float32x4_t minus_inf = vdupq_n_f32(-INFINITY);
+    const float32x4_t offset_v = vdupq_n_f32(offset);
+    for (; i + 4 <= length; i += 4) {
+        float32x4x2_t c = vld2q_f32(interleaved + 2*i); // Deinterleaves re and im
+        float32x4_t power = vmlaq_f32(vmulq_f32(c.val[0], c.val[0]), c.val[1], c.val[1]);
+
+        int32x4_t bits = vreinterpretq_s32_f32(power);
+        int32x4_t e = vshrq_n_s32(vsubq_s32(bits, sqrt_half), 23);
+        float32x4_t m = vreinterpretq_f32_s32(vsubq_s32(bits, vshlq_n_s32(e, 23)));
+        float32x4_t t = vdivq_f32(vsubq_f32(m, one), vaddq_f32(m, one));
+        float32x4_t t2 = vmulq_f32(t, t);
+        float32x4_t p = vmlaq_f32(vdupq_n_f32(LOG_C5), t2, vdupq_n_f32(LOG_C7));
+        p = vmlaq_f32(vdupq_n_f32(LOG_C3), p, t2);
+        p = vmlaq_f32(one, p, t2);
+        float32x4_t result = vmlaq_n_f32(vmlaq_f32(offset_v, t, p), vcvtq_f32_s32(e), M_LN2 / 2);
+
+        vst1q_f32(out + i, vbslq_f32(vcltq_f32(power, vdupq_n_f32(FLT_MIN)), minus_inf, result));
+    }
+#endif
+#endif
+
+    for (; i < length; ++i) {
+        real_t re = interleaved[2*i];
+        real_t im = interleaved[2*i + 1];
+        real_t power = re*re + im*im;
+#ifndef DOUBLE_PRECISION
+        out[i] = (power >= FLT_MIN) ? half_log_approx(power, offset) : -INFINITY;
+#else
+        out[i] = 0.5 * log(power) + offset;
+#endif
+    }
+}
+
+void fft_log(real_t* values, unsigned int length) {
+    for (unsigned int i = 0; i < length; ++i) {
+        values[i] = log(values[i]);
+    }
+}
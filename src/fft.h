@@ -0,0 +1,41 @@
+#ifndef FFT_H
+#define FFT_H
+
+#include "precision.h"
+
+#include <complex.h> // Before fftw3.h, so fftw_complex is the C99 complex type
+#include <fftw3.h>
+
+typedef FFTW(plan) fft_plan;
+typedef FFTW(complex) fft_complex;
+
+#define FFT_RIGOR_ESTIMATE   0U
+#define FFT_RIGOR_MEASURE    1U
+#define FFT_RIGOR_PATIENT    2U
+#define FFT_RIGOR_EXHAUSTIVE 3U
+
+// Creates a real to complex plan, reusing the wisdom cached in
+// $XDG_CACHE_HOME/term_pa_spectrum (one file per size and precision) and
+// storing it there if new wisdom had to be generated. Planning may
+// overwrite the arrays
+fft_plan fft_plan_r2c(int n_samples, real_t* in, fft_complex* out, unsigned int rigor, unsigned int flags);
+
+// Same, for howmany transforms in a single batch (i.e. one per channel), each
+// input in_distance values after the previous one (idem for the output)
+fft_plan fft_plan_r2c_many(int n_samples, int howmany, real_t* in, int in_distance, fft_complex* out, int out_distance, unsigned int rigor, unsigned int flags);
+
+// out[i] = scale * |in[i]|, vectorized (SSE/AVX2/NEON) in single precision
+void fft_magnitude(const fft_complex* in, real_t* out, unsigned int length, real_t scale);
+
+// out[i] = log(scale * |in[i]|), from the power |in[i]|^2 (no sqrt). In
+// single precision the log is approximated (SSE2/NEON, and scalar with the
+// same math): |error| < 2e-7 * (1 + |out[i]| + |log(scale)|), about an ulp
+// of the terms added. Powers under FLT_MIN (0 and denormals, |in| < 1e-19)
+// give -INFINITY, as silence
+void fft_log_magnitude(const fft_complex* in, real_t* out, unsigned int length, real_t scale);
+
+// values[i] = log(values[i]) in place, for magnitudes not computed here
+// (exact, as the output transform)
+void fft_log(real_t* values, unsigned int length);
+
+#endif
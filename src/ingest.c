@@ -0,0 +1,255 @@
+/*
+   This file is part of the 'term_pa_spectrum' program, which follows
+   a pulseaudio stream and displays its frequency spectrum through the
+   terminal.
+
+   Copyright (C) <2018> Jose Maria Perez Ramos
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.    See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.    If not, see <http://www.gnu.org/licenses/>.
+
+   Author: Jose Maria Perez Ramos <jose.m.perez.ramos+git gmail>
+   Date: 2018.08.13
+   Version: 1.0.0
+*/
+
+#include "ingest.h"
+
+#include <stdint.h>
+#include <string.h>
+#include <tgmath.h>
+
+#ifndef DOUBLE_PRECISION
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+#endif
+
+void ingest_level_reset(ingest_level* level) {
+    *level = (ingest_level) {
+        .silence = 1,
+        .peak = 0,
+        .sum_squares = 0,
+        .count = 0,
+    };
+}
+
+real_t ingest_level_rms(const ingest_level* level) {
+    return level->count ? sqrt(level->sum_squares / level->count) : 0;
+}
+
+void ingest_s16(const void* src, real_t* dst, size_t length, ingest_level* level) {
+    const unsigned char* bytes = (const unsigned char*) src;
+    size_t i = 0;
+    int nonzero = 0;
+    int max_sample = 0, min_sample = 0;
+    double sum_squares = 0;
+
+    // Unaligned loads everywhere, no fragment is discarded because of its address
+#ifndef DOUBLE_PRECISION
+#if defined(__AVX2__)
+    __m128i acc_or = _mm_setzero_si128(), acc_max = _mm_setzero_si128(), acc_min = _mm_setzero_si128();
+    __m256 acc_sq = _mm256_setzero_ps();
+    for (; i + 8 <= length; i += 8) {
+        __m128i v = _mm_loadu_si128((const __m128i*) (bytes + 2*i));
+        acc_or = _mm_or_si128(acc_or, v);
+        acc_max = _mm_max_epi16(acc_max, v);
+        acc_min = _mm_min_epi16(acc_min, v);
+        __m256 f = _mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(v));
+        acc_sq = _mm256_add_ps(acc_sq, _mm256_mul_ps(f, f));
+        _mm256_storeu_ps(dst + i, f);
+    }
+    int16_t lanes_max[8], lanes_min[8];
+    float lanes_sq[8];
+    _mm_storeu_si128((__m128i*) lanes_max, acc_max);
+    _mm_storeu_si128((__m128i*) lanes_min, acc_min);
+    _mm256_storeu_ps(lanes_sq, acc_sq);
+    nonzero = !_mm_testz_si128(acc_or, acc_or);
+    for (int lane = 0; lane < 8; ++lane) {
+        max_sample = (lanes_max[lane] > max_sample) ? lanes_max[lane] : max_sample;
+        min_sample = (lanes_min[lane] < min_sample) ? lanes_min[lane] : min_sample;
+        sum_squares += lanes_sq[lane];
+    }
+#elif defined(__SSE2__)
+    __m128i acc_or = _mm_setzero_si128(), acc_max = _mm_setzero_si128(), acc_min = _mm_setzero_si128();
+    __m128 acc_sq = _mm_setzero_ps();
+    for (; i + 8 <= length; i += 8) {
+        __m128i v = _mm_loadu_si128((const __m128i*) (bytes + 2*i));
+        acc_or = _mm_or_si128(acc_or, v);
+        acc_max = _mm_max_epi16(acc_max, v);
+        acc_min = _mm_min_epi16(acc_min, v);
+        // Sign extension: duplicate each 16 bit value and shift it down
+        __m128 lo = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16));
+        __m128 hi = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpackhi_epi16(v, v), 16));
+        acc_sq = _mm_add_ps(acc_sq, _mm_add_ps(_mm_mul_ps(lo, lo), _mm_mul_ps(hi, hi)));
+        _mm_storeu_ps(dst + i, lo);
+        _mm_storeu_ps(dst + i + 4, hi);
+    }
+    int16_t lanes_max[8], lanes_min[8];
+    float lanes_sq[4];
+    _mm_storeu_si128((__m128i*) lanes_max, acc_max);
+    _mm_storeu_si128((__m128i*) lanes_min, acc_min);
+    _mm_storeu_ps(lanes_sq, acc_sq);
+    nonzero = _mm_movemask_epi8(_mm_cmpeq_epi8(acc_or, _mm_setzero_si128())) != 0xFFFF;
+    for (int lane = 0; lane < 8; ++lane) {
+        max_sample = (lanes_max[lane] > max_sample) ? lanes_max[lane] : max_sample;
+        min_sample = (lanes_min[lane] < min_sample) ? lanes_min[lane] : min_sample;
+    }
+    for (int lane = 0; lane < 4; ++lane) {
+        sum_squares += lanes_sq[lane];
+    }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    int16x8_t acc_or = vdupq_n_s16(0), acc_max = vdupq_n_s16(0), acc_min = vdupq_n_s16(0);
+    float32x4_t acc_sq = vdupq_n_f32(0);
+    for (; i + 8 <= length; i += 8) {
+        int16x8_t v = vreinterpretq_s16_u8(vld1q_u8(bytes + 2*i));
+        acc_or = vorrq_s16(acc_or, v);
+        acc_max = vmaxq_s16(acc_max, v);
+        acc_min = vminq_s16(acc_min, v);
+        float32x4_t lo = vcvtq_f32_s32(vmovl_s16(vget_low_s16(v)));
+        float32x4_t hi = vcvtq_f32_s32(vmovl_s16(vget_high_s16(v)));
+        acc_sq = vmlaq_f32(vmlaq_f32(acc_sq, lo, lo), hi, hi);
+        vst1q_f32(dst + i, lo);
+        vst1q_f32(dst + i + 4, hi);
+    }
+    nonzero = vmaxvq_u16(vreinterpretq_u16_s16(acc_or)) != 0;
+    max_sample = vmaxvq_s16(acc_max);
+    min_sample = vminvq_s16(acc_min);
+    sum_squares = vaddvq_f32(acc_sq);
+#endif
+#endif
+
+    for (; i < length; ++i) {
+        int16_t sample;
+        memcpy(&sample, bytes + 2*i, sizeof sample);
+        nonzero |= sample;
+        max_sample = (sample > max_sample) ? sample : max_sample;
+        min_sample = (sample < min_sample) ? sample : min_sample;
+        sum_squares += (double) sample * sample;
+        dst[i] = sample;
+    }
+
+    real_t peak = ((max_sample > -min_sample) ? max_sample : -min_sample) / (real_t) 32768;
+    level->silence = level->silence && !nonzero;
+    level->peak = (peak > level->peak) ? peak : level->peak;
+    level->sum_squares += sum_squares / (32768.0 * 32768.0);
+    level->count += length;
+}
+
+void ingest_f32(const void* src, real_t* dst, size_t length, ingest_level* level) {
+    const unsigned char* bytes = (const unsigned char*) src;
+    size_t i = 0;
+    int nonzero = 0;
+    float peak = 0;
+    double sum_squares = 0;
+
+#ifndef DOUBLE_PRECISION
+#if defined(__AVX2__)
+    const __m256 abs_mask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7FFFFFFF));
+    __m256 acc_max = _mm256_setzero_ps(), acc_sq = _mm256_setzero_ps();
+    for (; i + 8 <= length; i += 8) {
+        __m256 f = _mm256_loadu_ps((const float*) (bytes + 4*i));
+        acc_max = _mm256_max_ps(acc_max, _mm256_and_ps(f, abs_mask));
+        acc_sq = _mm256_add_ps(acc_sq, _mm256_mul_ps(f, f));
+        _mm256_storeu_ps(dst + i, f);
+    }
+    float lanes_max[8], lanes_sq[8];
+    _mm256_storeu_ps(lanes_max, acc_max);
+    _mm256_storeu_ps(lanes_sq, acc_sq);
+    for (int lane = 0; lane < 8; ++lane) {
+        peak = (lanes_max[lane] > peak) ? lanes_max[lane] : peak;
+        sum_squares += lanes_sq[lane];
+    }
+#elif defined(__SSE2__)
+    const __m128 abs_mask = _mm_castsi128_ps(_mm_set1_epi32(0x7FFFFFFF));
+    __m128 acc_max = _mm_setzero_ps(), acc_sq = _mm_setzero_ps();
+    for (; i + 4 <= length; i += 4) {
+        __m128 f = _mm_loadu_ps((const float*) (bytes + 4*i));
+        acc_max = _mm_max_ps(acc_max, _mm_and_ps(f, abs_mask));
+        acc_sq = _mm_add_ps(acc_sq, _mm_mul_ps(f, f));
+        _mm_storeu_ps(dst + i, f);
+    }
+    float lanes_max[4], lanes_sq[4];
+    _mm_storeu_ps(lanes_max, acc_max);
+    _mm_storeu_ps(lanes_sq, acc_sq);
+    for (int lane = 0; lane < 4; ++lane) {
+        peak = (lanes_max[lane] > peak) ? lanes_max[lane] : peak;
+        sum_squares += lanes_sq[lane];
+    }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    float32x4_t acc_max = vdupq_n_f32(0), acc_sq = vdupq_n_f32(0);
+    for (; i + 4 <= length; i += 4) {
+        float32x4_t f = vreinterpretq_f32_u8(vld1q_u8(bytes + 4*i));
+        acc_max = vmaxq_f32(acc_max, vabsq_f32(f));
+        acc_sq = vmlaq_f32(acc_sq, f, f);
+        vst1q_f32(dst + i, f);
+    }
+    peak = vmaxvq_f32(acc_max);
+    sum_squares = vaddvq_f32(acc_sq);
+#endif
+#endif
+
+    for (; i < length; ++i) {
+        float sample;
+        memcpy(&sample, bytes + 4*i, sizeof sample);
+        float abs_sample = fabs(sample);
+        peak = (abs_sample > peak) ? abs_sample : peak;
+        sum_squares += (double) sample * sample;
+        dst[i] = sample;
+    }
+    nonzero = peak > 0; // The peak is the max of the absolute values
+
+    level->silence = level->silence && !nonzero;
+    level->peak = (peak > level->peak) ? peak : level->peak;
+    level->sum_squares += sum_squares;
+    level->count += length;
+}
+
+void ingest_samples(unsigned int format, const void* src, real_t* dst, size_t length, ingest_level* level) {
+    switch (format) {
+        case INGEST_FLOAT32LE:
+            ingest_f32(src, dst, length, level);
+            break;
+        case INGEST_S16LE:
+        default:
+            ingest_s16(src, dst, length, level);
+    }
+}
+
+size_t ingest_sample_size(unsigned int format) {
+    return (format == INGEST_FLOAT32LE) ? sizeof(float) : sizeof(int16_t);
+}
+
+void ingest_deinterleave(const real_t* src, real_t* dst, unsigned int dst_stride, unsigned int channels, size_t frames) {
+    if (channels == 2) {
+        // Fixed stride, vectorizable
+        real_t* restrict left = dst;
+        real_t* restrict right = dst + dst_stride;
+        for (size_t i = 0; i < frames; ++i) {
+            left[i] = src[2*i];
+            right[i] = src[2*i + 1];
+        }
+        return;
+    }
+
+    for (unsigned int channel = 0; channel < channels; ++channel) {
+        real_t* restrict channel_dst = dst + channel * dst_stride;
+        for (size_t i = 0; i < frames; ++i) {
+            channel_dst[i] = src[i * channels + channel];
+        }
+    }
+}
@@ -0,0 +1,39 @@
+#ifndef INGEST_H
+#define INGEST_H
+
+#include "precision.h"
+
+#include <stddef.h>
+
+#define INGEST_S16LE     0U
+#define INGEST_FLOAT32LE 1U
+
+// Input level of the samples ingested since the last reset, relative to
+// full scale (1.0)
+typedef struct {
+    unsigned int silence;    // All the samples were 0
+    real_t peak;             // Max absolute value
+    double sum_squares;
+    size_t count;
+} ingest_level;
+
+void ingest_level_reset(ingest_level* level);
+
+real_t ingest_level_rms(const ingest_level* level);
+
+// Converts samples to real_t and updates the level in the same pass.
+// Samples keep their scale (S16 is not normalized). src can have any
+// alignment
+void ingest_s16(const void* src, real_t* dst, size_t length, ingest_level* level);
+
+// With single precision this is just a copy (plus the level)
+void ingest_f32(const void* src, real_t* dst, size_t length, ingest_level* level);
+
+void ingest_samples(unsigned int format, const void* src, real_t* dst, size_t length, ingest_level* level);
+
+size_t ingest_sample_size(unsigned int format);
+
+// Splits interleaved frames, channel c is written to dst + c * dst_stride
+void ingest_deinterleave(const real_t* src, real_t* dst, unsigned int dst_stride, unsigned int channels, size_t frames);
+
+#endif
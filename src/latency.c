@@ -0,0 +1,149 @@
+/*
+   This file is part of the 'term_pa_spectrum' program, which follows
+   a pulseaudio stream and displays its frequency spectrum through the
+   terminal.
+
+   Copyright (C) <2018> Jose Maria Perez Ramos
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.    See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.    If not, see <http://www.gnu.org/licenses/>.
+
+   Author: Jose Maria Perez Ramos <jose.m.perez.ramos+git gmail>
+   Date: 2018.08.13
+   Version: 1.0.0
+*/
+
+#include "latency.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Values below 8 us have their own bucket, then every power of two is split
+// in 8 linear sub-buckets: 8-15 (1 us each), 16-31 (2 us each)...
+#define LATENCY_SUB_BITS 3U
+#define LATENCY_SUB      (1U << LATENCY_SUB_BITS)
+#define LATENCY_BUCKETS  ((32U - LATENCY_SUB_BITS + 1) * LATENCY_SUB)
+
+typedef struct {
+    uint32_t buckets[LATENCY_BUCKETS];
+    uint32_t count;
+    uint32_t max_us;
+} latency_histogram;
+
+struct latency_stats {
+    int fd;
+    uint64_t period_ns;
+    uint64_t last_dump_ns;
+    latency_histogram histograms[LATENCY_STAGES];
+};
+
+static const char* stage_names[LATENCY_STAGES] = {
+    [LATENCY_CAPTURE] = "capture",
+    [LATENCY_FFT] = "fft",
+    [LATENCY_RENDER] = "render",
+    [LATENCY_WRITE] = "write",
+    [LATENCY_TOTAL] = "total",
+};
+
+static unsigned int bucket_index(uint32_t us) {
+    if (us < LATENCY_SUB) {
+        return us;
+    }
+    unsigned int octave = 31 - __builtin_clz(us); // >= LATENCY_SUB_BITS
+    unsigned int sub = (us >> (octave - LATENCY_SUB_BITS)) & (LATENCY_SUB - 1);
+    return (octave - LATENCY_SUB_BITS + 1) * LATENCY_SUB + sub;
+}
+
+// Upper bound (exclusive) of the bucket
+static uint32_t bucket_limit(unsigned int index) {
+    if (index < LATENCY_SUB) {
+        return index + 1;
+    }
+    unsigned int octave = index / LATENCY_SUB + LATENCY_SUB_BITS - 1;
+    unsigned int sub = index % LATENCY_SUB;
+    return (uint32_t) ((uint64_t) (LATENCY_SUB + sub + 1) << (octave - LATENCY_SUB_BITS));
+}
+
+static uint32_t percentile(const latency_histogram* histogram, unsigned int per_mille) {
+    uint64_t target = ((uint64_t) histogram->count * per_mille + 999) / 1000;
+    uint64_t accumulated = 0;
+    for (unsigned int i = 0; i < LATENCY_BUCKETS; ++i) {
+        accumulated += histogram->buckets[i];
+        if (accumulated >= target) {
+            uint32_t limit = bucket_limit(i);
+            return (limit < histogram->max_us) ? limit : histogram->max_us;
+        }
+    }
+    return histogram->max_us;
+}
+
+latency_stats* latency_init(int fd, unsigned int period_ms) {
+    latency_stats* stats = NULL;
+    if ((stats = calloc(1, sizeof *stats))) {
+        stats->fd = fd;
+        stats->period_ns = (uint64_t) period_ms * 1000000U;
+        stats->last_dump_ns = latency_now();
+    }
+    return stats;
+}
+
+void latency_deinit(latency_stats* stats) {
+    free(stats);
+}
+
+void latency_record(latency_stats* stats, unsigned int stage, uint64_t start_ns, uint64_t end_ns) {
+    if (!start_ns || end_ns < start_ns) {
+        return; // Nothing captured yet
+    }
+    uint64_t us = (end_ns - start_ns) / 1000;
+    uint32_t value = (us > UINT32_MAX) ? UINT32_MAX : us;
+    latency_histogram* histogram = &stats->histograms[stage];
+
+    histogram->buckets[bucket_index(value)]++;
+    histogram->count++;
+    if (value > histogram->max_us) {
+        histogram->max_us = value;
+    }
+}
+
+void latency_maybe_dump(latency_stats* stats, uint64_t now_ns) {
+    if (now_ns - stats->last_dump_ns >= stats->period_ns) {
+        latency_dump(stats);
+        stats->last_dump_ns = now_ns;
+    }
+}
+
+void latency_dump(latency_stats* stats) {
+    char line[512];
+    int length = snprintf(line, sizeof line, "Latency (us)");
+
+    for (unsigned int stage = 0; stage < LATENCY_STAGES && length < (int) sizeof line; ++stage) {
+        latency_histogram* histogram = &stats->histograms[stage];
+        length += snprintf(line + length, sizeof line - length, " | %s n=%u p50=%u p99=%u max=%u", stage_names[stage],
+                histogram->count, percentile(histogram, 500), percentile(histogram, 990), histogram->max_us);
+    }
+    if (length < (int) sizeof line - 1) {
+        line[length++] = '\n';
+    } else {
+        length = sizeof line;
+        line[length - 1] = '\n';
+    }
+
+    // One write, so it's not mixed with other output on the same fd
+    if (write(stats->fd, line, length) < 0) {
+        // Nowhere to report it
+    }
+    memset(stats->histograms, 0, sizeof stats->histograms);
+}
@@ -0,0 +1,37 @@
+#ifndef LATENCY_H
+#define LATENCY_H
+
+#include <stdint.h>
+#include <time.h>
+
+// Per stage latency histograms, dumped (and reset) periodically as one
+// line with p50/p99/max per stage. Buckets are fixed: 8 per power of two
+// of microseconds, so percentiles are within 12.5%
+
+#define LATENCY_CAPTURE 0U // Pushed by the capture thread -> taken by the DSP thread
+#define LATENCY_FFT     1U // Window complete -> spectrum ready (FFT, magnitude, output update)
+#define LATENCY_RENDER  2U // Spectrum ready -> line rendered (includes waiting for the fps tick)
+#define LATENCY_WRITE   3U // Line rendered -> written to stdout
+#define LATENCY_TOTAL   4U // Pushed by the capture thread -> written to stdout
+#define LATENCY_STAGES  5U
+
+typedef struct latency_stats latency_stats;
+
+latency_stats* latency_init(int fd, unsigned int period_ms);
+
+void latency_deinit(latency_stats* stats);
+
+static inline uint64_t latency_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000U + ts.tv_nsec;
+}
+
+void latency_record(latency_stats* stats, unsigned int stage, uint64_t start_ns, uint64_t end_ns);
+
+// Dumps and resets the histograms if the period has elapsed since the last dump
+void latency_maybe_dump(latency_stats* stats, uint64_t now_ns);
+
+void latency_dump(latency_stats* stats);
+
+#endif
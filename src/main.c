@@ -23,8 +23,19 @@
    Version: 1.0.0
 */
 
+#include "decimator.h"
+#include "fanout.h"
+#include "fft.h"
+#include "ingest.h"
+#include "latency.h"
+#include "multires.h"
+#include "offline.h"
 #include "output.h"
 #include "pulseaudio_follow_sink.h"
+#include "shm_feed.h"
+#include "sliding_window.h"
+#include "sparse_dft.h"
+#include "view.h"
 #include <complex.h>
 #include <ctype.h>
 #include <errno.h>
@@ -32,21 +43,27 @@
 #include <getopt.h>
 #include <locale.h>
 #include <math.h>
+#include <poll.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/ioctl.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
 #include <time.h>
 #include <unistd.h>
 
-float timeSinceLastUpdate() {
-    static struct timespec previous;
+float timeSinceLastUpdate(struct timespec* previous) {
     struct timespec current;
     clock_gettime(CLOCK_MONOTONIC_RAW, &current);
-    float delta_ms = ((float) (current.tv_sec - previous.tv_sec)) * 1000 + ((float) (current.tv_nsec - previous.tv_nsec)) / 1000000;
+    float delta_ms = ((float) (current.tv_sec - previous->tv_sec)) * 1000 + ((float) (current.tv_nsec - previous->tv_nsec)) / 1000000;
 
-    previous.tv_sec = current.tv_sec;
-    previous.tv_nsec = current.tv_nsec;
+    previous->tv_sec = current.tv_sec;
+    previous->tv_nsec = current.tv_nsec;
     return delta_ms;
 }
 
@@ -61,40 +78,43 @@ int atoi_exit_if_invalid(char* value, char option) {
     exit(1);
 }
 
-double atof_exit_if_invalid(char* value, char option) {
-    double ret = atof(value);
-    if (ret > 0.0) {
-        return ret;
+int atoi_zero_exit_if_invalid(char* value, char option) {
+    if (value && strcmp(value, "0") == 0) {
+        return 0;
     }
-
-    fprintf(stderr, "Option `-%c' has invalid value <%s>\n", option, (value) ? value : "NULL");
-    exit(1);
+    return atoi_exit_if_invalid(value, option);
 }
 
 
 typedef struct {char* s; int v;} var;
-var charset_string2value[] = {
-    {.s = "bars", .v = OUTPUT_CHARSET_BARS},
-    {.s = "braille", .v = OUTPUT_CHARSET_BRAILLE},
-    {.s = "wide_braille", .v = OUTPUT_CHARSET_BRAILLE_WIDE},
-};
-var grouping_string2value[] = {
-    {.s = "none",   .v = OUTPUT_NO_GROUPING},
-    {.s = "lineal", .v = OUTPUT_LINEAL_GROUPING},
-    {.s = "log",    .v = OUTPUT_LOGARITMIC_GROUPING},
-};
-var groupingfunc_string2value[] = {
-    {.s = "none", .v = OUTPUT_NO_GROUPING_FUNC},
-    {.s = "max",  .v = OUTPUT_MAX_GROUPING_FUNC},
-    {.s = "avg",  .v = OUTPUT_AVG_GROUPING_FUNC},
-};
 var transform_string2value[] = {
     {.s = "none", .v = OUTPUT_NO_TRANSFORM},
     {.s = "log",  .v = OUTPUT_LOGARITMIC_TRANSFORM},
 };
-var smoothing_string2value[] = {
-    {.s = "none", .v = OUTPUT_NO_SMOOTH},
-    {.s = "exp2", .v = OUTPUT_EXP2_SMOOTH},
+var capture_string2value[] = {
+    {.s = "f32", .v = INGEST_FLOAT32LE},
+    {.s = "s16", .v = INGEST_S16LE},
+};
+var rigor_string2value[] = {
+    {.s = "estimate",   .v = FFT_RIGOR_ESTIMATE},
+    {.s = "measure",    .v = FFT_RIGOR_MEASURE},
+    {.s = "patient",    .v = FFT_RIGOR_PATIENT},
+    {.s = "exhaustive", .v = FFT_RIGOR_EXHAUSTIVE},
+};
+#define ENGINE_AUTO   0
+#define ENGINE_FFT    1
+#define ENGINE_SPARSE 2
+#define ENGINE_MULTIRES 3
+var engine_string2value[] = {
+    {.s = "auto",   .v = ENGINE_AUTO},
+    {.s = "fft",    .v = ENGINE_FFT},
+    {.s = "sparse", .v = ENGINE_SPARSE},
+    {.s = "multires", .v = ENGINE_MULTIRES},
+};
+var shm_content_string2value[] = {
+    {.s = "both",     .v = SHM_FEED_POINTS | SHM_FEED_SPECTRUM},
+    {.s = "points",   .v = SHM_FEED_POINTS},
+    {.s = "spectrum", .v = SHM_FEED_SPECTRUM},
 };
 
 int find_string_var(char* value, char option, var* values, int n_values) {
@@ -109,119 +129,958 @@ int find_string_var(char* value, char option, var* values, int n_values) {
 }
 /////////////////
 
+// SERVER ///////
+// With --serve, the clients of a Unix socket display the spectrum, each one
+// with its own view options. Clients with the same options share a view,
+// updated and rendered once per frame
+#define SERVER_MAX_CLIENTS 64
+
+typedef struct {
+    view_config config;
+    view* view;                      // NULL if the slot is free
+    unsigned int clients;
+    char* line;                      // Rendered for every client
+    size_t length;
+} served_view;
+
+typedef struct {
+    fanout* fanout;
+    view_config defaults;            // Command line options, requests override them
+    const double* frequencies;
+    unsigned int transform;          // The same for every view
+    served_view* views;              // A slot per client, plus one: the old view is released after the new one is served
+    int joined;                      // A client was served a view since it was last checked
+} server;
+/////////////////
+
+// OUTPUTS //////
+// Local views: the command line options and the -V ones, all of them fed
+// with the same spectrum. Each one is a row of stdout or goes to its own fd
+typedef struct {
+    view* view;
+    int fd;                          // -1 is a row of stdout
+    char* frame;                     // Newline char + line, only with its own fd
+    char* last_line;                 // Last written line, to skip identical ones
+    size_t last_line_length;
+    size_t line_size;                // Allocated for frame (+1) and last_line
+} local_output;
+/////////////////
+
 // CB INFO //////
 typedef struct {
     float time_without_sound;
     unsigned int no_sound_wait_time_ms;
-    unsigned int no_sound_sleep_time_ms;
 
-    fftw_complex* fftw_out;
-    fftw_plan plan;
+    fft_complex* fftw_out;
+    fft_plan plan;
+    sparse_dft** sparse;             // One per channel, instead of the plan, if it's cheaper
+    multires** multires;             // One per channel, instead of the plan, for log grouping
     int n_out_values;
+    unsigned int n_samples;
 
-    double* graph;
-    double* empty_graph;
+    real_t* graph;
+    real_t* empty_graph;
 
     char new_line_char;
     unsigned int stats;
-    void* out_ctx;
+    pa_follow_sink* sink;            // For its stats
+    spsc_ring* ring;
+    ingest_level level;              // Input level of the last window hop
+    unsigned int capture_format;     // INGEST_*
+    size_t sample_size;
+    real_t magnitude_scale;          // Float samples are scaled to S16 range here, not per sample
+    unsigned int first_bin;          // Bins displayed by any view, the only ones computed from the FFT
+    unsigned int n_bins;
+    int log_magnitude;               // The log transform is done once for every view (fused with the FFT magnitude)
+    shm_feed* feed;                  // Every updated frame is published here, if set
+    unsigned int channels;
+    unsigned int channel_stride;     // Distance between channel windows
+    real_t* interleaved;             // Scratch for multichannel or decimated ingest
+    decimator** decimators;          // One per channel, NULL if the capture rate is used
+    double effective_rate;           // After decimation
+    local_output* outputs;           // outputs[0] has the command line options, the only one when serving
+    unsigned int n_outputs;
+    unsigned int n_rows;             // Outputs on stdout
+    server* server;                  // NULL unless serving
+    view_config options;             // Command line view options, reloaded lines override them
+    const char* config_path;         // Reloaded on SIGHUP, NULL if not set
+    int auto_width;                  // The stdout rows take the terminal width
+    int signal_fd;                   // SIGHUP with config_path, SIGWINCH with auto_width, -1 without both
+
+    // Render scheduling
+    unsigned int fps;                // 0 renders every update
+    int pending;                     // What has to be rendered on next tick
+    char* frame;                     // Prefix + rows + stats, written at once
+    size_t frame_size;
+    char* last_line;                 // Last written rows, to skip identical ones
+    size_t last_line_length;
+    int rows_written;                // Next rows overwrite the previous ones
+    struct timespec last_update;
+    struct timespec last_render;
+
+    // Latency instrumentation, NULL unless requested
+    latency_stats* latency;
+    uint64_t pushed_ns;              // Push time of the newest data taken from the ring
+    uint64_t spectrum_ns;            // When the pending spectrum was ready
+    uint64_t spectrum_pushed_ns;     // Push time of the data of the pending spectrum
 } cb_info_t;
 
-int process_data_from_pa(int silence, void* userdata) {
+// One write(2) per frame, unless the terminal only takes part of it
+void write_all(int fd, const char* buffer, size_t length) {
+    while (length) {
+        ssize_t written = write(fd, buffer, length);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return;
+        }
+        buffer += written;
+        length -= written;
+    }
+}
+
+// Extends [*first_bin, *last_bin] (empty if first > last) to the data
+// range of v
+static void add_data_range(view* v, unsigned int* first_bin, unsigned int* last_bin) {
+    unsigned int first, last;
+    view_data_range(v, &first, &last);
+    if (first > last) {
+        return;
+    }
+    if (*first_bin > *last_bin) {
+        *first_bin = first;
+        *last_bin = last;
+    } else {
+        *first_bin = (first < *first_bin) ? first : *first_bin;
+        *last_bin = (last > *last_bin) ? last : *last_bin;
+    }
+}
+
+// The sparse and multires engines only compute the bins they were set up
+// with, the FFT has every bin
+static int computes_data_range(cb_info_t* cb_info, view* v) {
+    unsigned int first_bin, last_bin;
+    view_data_range(v, &first_bin, &last_bin);
+    return cb_info->plan || first_bin > last_bin || (first_bin >= cb_info->first_bin && last_bin < cb_info->first_bin + cb_info->n_bins);
+}
+
+// Only the bins some view displays are computed from the FFT. The other
+// engines are set up once, for the local views
+static void update_data_range(cb_info_t* cb_info) {
+    if (!cb_info->plan) {
+        return;
+    }
+    unsigned int first_bin = 1, last_bin = 0;
+    for (unsigned int i = 0; i < cb_info->n_outputs; ++i) {
+        add_data_range(cb_info->outputs[i].view, &first_bin, &last_bin);
+    }
+    for (unsigned int i = 0; cb_info->server && i <= SERVER_MAX_CLIENTS; ++i) {
+        if (cb_info->server->views[i].view) {
+            add_data_range(cb_info->server->views[i].view, &first_bin, &last_bin);
+        }
+    }
+    cb_info->first_bin = first_bin;
+    cb_info->n_bins = (first_bin <= last_bin) ? last_bin - first_bin + 1 : 0;
+}
+
+static void* serve_request(void* userdata, const char* request, void* previous, char* error, size_t error_size) {
     cb_info_t* cb_info = (cb_info_t*) userdata;
-    char new_line_char = cb_info->new_line_char;
-    float elapsed = timeSinceLastUpdate();
+    server* s = cb_info->server;
+
+    view_config config = s->defaults;
+    int invalid = view_config_parse(&config, request);
+    if (invalid) {
+        snprintf(error, error_size, (invalid == '-') ? "options are \"-<letter> <value>\"" : "option `-%c' is invalid", invalid);
+        return NULL;
+    }
+    if (config.start_freq >= config.end_freq || config.num_points > FANOUT_MAX_FRAME) {
+        snprintf(error, error_size, "invalid frequency range or number of columns");
+        return NULL;
+    }
+    s->joined = 1;
+
+    served_view* free_slot = NULL;
+    for (unsigned int i = 0; i <= SERVER_MAX_CLIENTS; ++i) {
+        served_view* served = s->views + i;
+        if (served->view && view_config_equal(&served->config, &config)) {
+            served->clients++;
+            return served;
+        }
+        if (!served->view && !free_slot) {
+            free_slot = served;
+        }
+    }
+
+    view* v = view_init(&config, cb_info->n_out_values, s->frequencies, cb_info->channels, s->transform);
+    if (!v) {
+        snprintf(error, error_size, "out of memory");
+        return NULL;
+    }
+    if (view_line_max_length(v) > FANOUT_MAX_FRAME) {
+        view_deinit(v);
+        snprintf(error, error_size, "lines would be longer than %d bytes", FANOUT_MAX_FRAME);
+        return NULL;
+    }
+    if (!computes_data_range(cb_info, v)) {
+        view_deinit(v);
+        snprintf(error, error_size, "frequency range out of the computed one (the server needs -E fft)");
+        return NULL;
+    }
+    char* line = (char*) malloc(view_line_max_length(v));
+    if (!line) {
+        view_deinit(v);
+        snprintf(error, error_size, "out of memory");
+        return NULL;
+    }
+    view_set_log_input(v, cb_info->log_magnitude);
+    *free_slot = (served_view) {
+        .config = config,
+        .view = v,
+        .clients = 1,
+        .line = line,
+    };
+    update_data_range(cb_info);
+    return free_slot;
+}
+
+static void serve_release(void* userdata, void* served_ptr) {
+    cb_info_t* cb_info = (cb_info_t*) userdata;
+    served_view* served = (served_view*) served_ptr;
+    if (--served->clients) {
+        return;
+    }
+    view_deinit(served->view);
+    free(served->line);
+    served->view = NULL;
+    update_data_range(cb_info);
+}
+
+server* server_init(const char* path, const view_config* defaults, const double* frequencies, unsigned int transform, cb_info_t* cb_info) {
+    server* s = (server*) calloc(1, sizeof(server));
+    s->defaults = *defaults;
+    s->frequencies = frequencies;
+    s->transform = transform;
+    s->views = (served_view*) calloc(SERVER_MAX_CLIENTS + 1, sizeof(served_view));
+    if (!(s->fanout = fanout_init(path, SERVER_MAX_CLIENTS, serve_request, serve_release, cb_info))) {
+        free(s->views);
+        free(s);
+        return NULL;
+    }
+    return s;
+}
+
+void server_deinit(server* s) {
+    fanout_deinit(s->fanout); // Releases every view
+    free(s->views);
+    free(s);
+}
+
+static void serve_update(server* s, real_t* data, unsigned int channel_distance) {
+    for (unsigned int i = 0; i <= SERVER_MAX_CLIENTS; ++i) {
+        if (s->views[i].view) {
+            view_update(s->views[i].view, data, channel_distance);
+        }
+    }
+}
+
+// Every view is rendered once, then a frame is sent to every client
+static void serve_frame(server* s, int silence) {
+    for (unsigned int i = 0; i <= SERVER_MAX_CLIENTS; ++i) {
+        served_view* served = s->views + i;
+        if (served->view) {
+            served->length = view_render(served->view, served->line, silence);
+        }
+    }
+    for (unsigned int client = 0; client < fanout_clients(s->fanout); ++client) {
+        served_view* served = (served_view*) fanout_served(s->fanout, client);
+        if (served) {
+            fanout_send(s->fanout, client, served->line, served->length);
+        }
+    }
+}
+
+#define PENDING_NONE    0
+#define PENDING_GRAPH   1
+#define PENDING_SILENCE 2
+
+#define FRAME_PREFIX 16 // Newline char, or the way back to the first row
+
+// Several rows are rewritten in place with '\r': the cursor goes back up
+// to the first one and every row is cleared up to its end (ANSI)
+static size_t render_rows(cb_info_t* cb_info, char* line, int silence) {
+    int in_place = cb_info->n_rows > 1 && cb_info->new_line_char == '\r';
+    size_t length = 0;
+    unsigned int row = 0;
+    for (unsigned int i = 0; i < cb_info->n_outputs; ++i) {
+        if (cb_info->outputs[i].fd >= 0) {
+            continue;
+        }
+        if (row++) {
+            line[length++] = '\n';
+        }
+        length += view_render(cb_info->outputs[i].view, line + length, silence);
+        if (in_place) {
+            memcpy(line + length, "\033[K", 3);
+            length += 3;
+        }
+    }
+    return length;
+}
+
+static void render_to_fd(local_output* output, char new_line_char, int silence) {
+    char* line = output->frame + 1;
+    size_t length = view_render(output->view, line, silence);
+    if (length == output->last_line_length && memcmp(line, output->last_line, length) == 0) {
+        return;
+    }
+    memcpy(output->last_line, line, length);
+    output->last_line_length = length;
+    output->frame[0] = new_line_char;
+    write_all(output->fd, output->frame, length + 1);
+}
+
+// Writes the newest data, if any and if it changed, returns if it was pending
+int render_output(cb_info_t* cb_info) {
+    if (cb_info->pending == PENDING_NONE) {
+        return 0;
+    }
+
+    char* line = cb_info->frame + FRAME_PREFIX;
+    int graph = cb_info->pending == PENDING_GRAPH;
+    size_t length = 0;
+    if (cb_info->server) {
+        serve_frame(cb_info->server, !graph);
+    } else {
+        length = render_rows(cb_info, line, !graph);
+        for (unsigned int i = 1; i < cb_info->n_outputs; ++i) {
+            if (cb_info->outputs[i].fd >= 0) {
+                render_to_fd(cb_info->outputs + i, cb_info->new_line_char, !graph);
+            }
+        }
+    }
+    cb_info->pending = PENDING_NONE;
+
+    uint64_t rendered_ns = 0;
+    if (cb_info->latency && graph) {
+        rendered_ns = latency_now();
+        latency_record(cb_info->latency, LATENCY_RENDER, cb_info->spectrum_ns, rendered_ns);
+    }
+    if (cb_info->server) {
+        // Already sent, rendering includes it
+        if (rendered_ns) {
+            latency_record(cb_info->latency, LATENCY_TOTAL, cb_info->spectrum_pushed_ns, rendered_ns);
+        }
+        return 1;
+    }
+
+    if (length == cb_info->last_line_length && memcmp(line, cb_info->last_line, length) == 0) {
+        return 1;
+    }
+    memcpy(cb_info->last_line, line, length);
+    cb_info->last_line_length = length;
+
+    float elapsed = timeSinceLastUpdate(&cb_info->last_render);
+    char* frame = line;
+    if (cb_info->rows_written && cb_info->n_rows > 1 && cb_info->new_line_char == '\r') {
+        char up[FRAME_PREFIX];
+        int up_length = snprintf(up, sizeof up, "\033[%uA\r", cb_info->n_rows - 1);
+        frame -= up_length;
+        memcpy(frame, up, up_length);
+    } else {
+        *--frame = cb_info->new_line_char;
+    }
+    cb_info->rows_written = 1;
+    length += line - frame;
+
+    ///////////////////
+    // Stats
+    if (cb_info->stats) {
+        pa_follow_sink_stats sink_stats = {0};
+        if (cb_info->sink) {
+            pa_follow_sink_get_stats(cb_info->sink, &sink_stats);
+        }
+        size_t remaining = cb_info->frame + cb_info->frame_size - (frame + length);
+        int stats_length = snprintf(frame + length, remaining, "> % 4.0f ms % 5.0f fps % 6.1f/% 6.1f dBFS % 6.0f Hz % 5.2f Hz/bin PA % 5.1f ms %u ovf %u hole %zu drop",
+                elapsed, 1000/elapsed, 20 * log10(cb_info->level.peak), 20 * log10(ingest_level_rms(&cb_info->level)),
+                cb_info->effective_rate, cb_info->effective_rate / cb_info->n_samples,
+                sink_stats.latency_us / 1000.0, sink_stats.overflows, sink_stats.holes, spsc_ring_dropped(cb_info->ring) / (cb_info->sample_size * cb_info->channels));
+        if (stats_length > 0) {
+            // Truncated if it does not fit, snprintf returns what it would have written
+            length += ((size_t) stats_length < remaining) ? (size_t) stats_length : remaining - 1;
+        }
+    }
+
+    write_all(STDOUT_FILENO, frame, length);
+
+    if (rendered_ns) {
+        uint64_t written_ns = latency_now();
+        latency_record(cb_info->latency, LATENCY_WRITE, rendered_ns, written_ns);
+        latency_record(cb_info->latency, LATENCY_TOTAL, cb_info->spectrum_pushed_ns, written_ns);
+    }
+
+    return 1;
+}
+
+// Values after output_update, so the spectrum is transformed too. Only the
+// command line view is published, the computed range may be wider
+static void publish_frame(cb_info_t* cb_info, const real_t* spectrum, unsigned int channel_distance) {
+    view* main_view = cb_info->outputs[0].view;
+    unsigned int first_bin, last_bin;
+    view_data_range(main_view, &first_bin, &last_bin);
+    for (unsigned int c = 0; c < cb_info->channels; ++c) {
+        unsigned int num_points;
+        real_t min, max;
+        const real_t* points = output_values(view_output(main_view, c), &num_points, &min, &max);
+        shm_feed_write_points(cb_info->feed, c, points, num_points, min, max);
+        shm_feed_write_spectrum(cb_info->feed, c, spectrum + c * channel_distance + first_bin);
+    }
+    shm_feed_publish(cb_info->feed);
+}
+
+int process_data_from_pa(real_t* window, int silence, void* userdata) {
+    cb_info_t* cb_info = (cb_info_t*) userdata;
+    float elapsed = timeSinceLastUpdate(&cb_info->last_update);
 
     ///////////////////
     // Input
     if (silence) {
         if (cb_info->time_without_sound > cb_info->no_sound_wait_time_ms) {
-            fprintf(stdout, "%c%ls", new_line_char, output_print_silence(cb_info->out_ctx));
-            fflush(stdout);
-            return cb_info->no_sound_sleep_time_ms;
+            cb_info->pending = PENDING_SILENCE;
+            render_output(cb_info); // Always, it's going to sleep
+            return 1;
         }
 
         cb_info->time_without_sound += elapsed;
 #ifdef DEBUG
         fprintf(stderr, "Silence for %3.0f ms", cb_info->time_without_sound);
 #endif
-        fprintf(stdout, "%c%ls", new_line_char, output_print(cb_info->out_ctx, cb_info->empty_graph));
-        fflush(stdout);
+        for (unsigned int i = 0; i < cb_info->n_outputs; ++i) {
+            view_update(cb_info->outputs[i].view, cb_info->empty_graph, 0);
+        }
+        if (cb_info->server) {
+            serve_update(cb_info->server, cb_info->empty_graph, 0);
+        }
+        if (cb_info->feed) {
+            publish_frame(cb_info, cb_info->empty_graph, 0);
+        }
+        cb_info->pending = PENDING_GRAPH;
+        if (!cb_info->fps) {
+            render_output(cb_info);
+        }
         return 0;
     }
     cb_info->time_without_sound = 0;
 
     ///////////////////
     // Process data
-    fftw_execute(cb_info->plan);
-
-    for (int i = 0; i < cb_info->n_out_values; ++i) {
-        fftw_complex c_out = cb_info->fftw_out[i];
-        cb_info->graph[i] = sqrt(creal(c_out)*creal(c_out) + cimag(c_out)*cimag(c_out));
+    // All the channels are transformed by the same (batched) plan, the
+    // sparse bins are already up to date
+    uint64_t start_ns = cb_info->latency ? latency_now() : 0;
+    // The views never transform the shared spectrum themselves: the log is
+    // done here, once for the bins any of them displays
+    if (cb_info->sparse || cb_info->multires) {
+        for (unsigned int c = 0; c < cb_info->channels; ++c) {
+            real_t* values = cb_info->graph + c * cb_info->n_out_values;
+            if (cb_info->sparse) {
+                sparse_dft_magnitude(cb_info->sparse[c], window + c * cb_info->channel_stride, values, cb_info->magnitude_scale);
+            } else {
+                multires_magnitude(cb_info->multires[c], values, cb_info->magnitude_scale);
+            }
+            if (cb_info->log_magnitude) {
+                fft_log(values + cb_info->first_bin, cb_info->n_bins);
+            }
+        }
+    } else {
+        FFTW(execute_dft_r2c)(cb_info->plan, window, cb_info->fftw_out);
+        for (unsigned int c = 0; c < cb_info->channels; ++c) {
+            unsigned int offset = c * cb_info->n_out_values + cb_info->first_bin;
+            if (cb_info->log_magnitude) {
+                fft_log_magnitude(cb_info->fftw_out + offset, cb_info->graph + offset, cb_info->n_bins, cb_info->magnitude_scale);
+            } else {
+                fft_magnitude(cb_info->fftw_out + offset, cb_info->graph + offset, cb_info->n_bins, cb_info->magnitude_scale);
+            }
+        }
     }
 
-    ///////////////////
-    // Output
-    // TODO Update output only based on fps
-    fprintf(stdout, "%c%ls", new_line_char, output_print(cb_info->out_ctx, cb_info->graph));
-    fflush(stdout);
 #ifdef DEBUG
-    fprintf(stderr,  "<%c", new_line_char);
-    for (int i = 1; i < 41; ++i) {
+    fprintf(stderr,  "<%c", cb_info->new_line_char);
+    for (int i = 1; i < 41 && i < cb_info->n_out_values; ++i) {
         fprintf(stderr, "%4.0f ", cb_info->graph[i]/1000);
     }
 #endif
 
     ///////////////////
-    // Stats
-    if (cb_info->stats) {
-        fprintf(stdout, "> % 4.0f ms % 5.0f fps", elapsed, 1000/elapsed);
+    // Output
+    // Smoothing follows every window, rendering only happens on the fps ticks
+    for (unsigned int i = 0; i < cb_info->n_outputs; ++i) {
+        view_update(cb_info->outputs[i].view, cb_info->graph, cb_info->n_out_values);
+    }
+    if (cb_info->server) {
+        serve_update(cb_info->server, cb_info->graph, cb_info->n_out_values);
+    }
+    if (cb_info->feed) {
+        publish_frame(cb_info, cb_info->graph, cb_info->n_out_values);
+    }
+    if (cb_info->latency) {
+        cb_info->spectrum_ns = latency_now();
+        cb_info->spectrum_pushed_ns = cb_info->pushed_ns;
+        latency_record(cb_info->latency, LATENCY_FFT, start_ns, cb_info->spectrum_ns);
+    }
+    cb_info->pending = PENDING_GRAPH;
+    if (!cb_info->fps) {
+        render_output(cb_info);
     }
 
     return 0;
 }
 /////////////////
 
+// RELOAD ///////
+// With --config, SIGHUP re-reads the view options of the local outputs from
+// a file, a line per output: the command line one, then the -V ones. They
+// are applied between frames, capture and FFT plan are untouched
+
+// Grows *buffer to size bytes, it's kept as is if it cannot be done
+static int grow_buffer(char** buffer, size_t size) {
+    char* grown = (char*) realloc(*buffer, size);
+    if (!grown) {
+        return -1;
+    }
+    *buffer = grown;
+    return 0;
+}
+
+// Frame buffers only grow, so they still fit the previous lines if it
+// fails. Returns -1 then
+static int resize_frames(cb_info_t* cb_info) {
+    size_t rows_max_length = 0;
+    for (unsigned int i = 0; i < cb_info->n_outputs; ++i) {
+        local_output* output = cb_info->outputs + i;
+        size_t line_max_length = view_line_max_length(output->view);
+        if (output->fd < 0) {
+            rows_max_length += line_max_length + 4; // Separator and clear to the end
+        } else if (line_max_length > output->line_size) {
+            if (grow_buffer(&output->frame, 1 + line_max_length) || grow_buffer(&output->last_line, line_max_length)) {
+                return -1;
+            }
+            output->line_size = line_max_length;
+        }
+    }
+    size_t frame_size = FRAME_PREFIX + rows_max_length + 128;
+    if (frame_size > cb_info->frame_size) {
+        if (grow_buffer(&cb_info->frame, frame_size) || grow_buffer(&cb_info->last_line, frame_size)) {
+            return -1;
+        }
+        cb_info->frame_size = frame_size;
+    }
+    return 0;
+}
+
+// Applies config to a view, or keeps the previous one if the buffers
+// cannot grow. Returns -1 then
+static int reconfigure_output(cb_info_t* cb_info, view* v, const view_config* config) {
+    view_config old_config = *view_get_config(v);
+    if (view_reconfigure(v, config)) {
+        return -1;
+    }
+    if (resize_frames(cb_info)) {
+        view_reconfigure(v, &old_config); // It fits the frames
+        return -1;
+    }
+    return 0;
+}
+
+// Points of the main view the shm feed layout has room for, 0 is any
+static unsigned int feed_max_points(cb_info_t* cb_info) {
+    return cb_info->feed ? shm_feed_max_points(cb_info->feed) : 0;
+}
+
+// The bins have to be computed, and the shm feed layout has the bins and
+// the points of the main view
+static int reload_fits(cb_info_t* cb_info, unsigned int output, unsigned int old_first_bin, unsigned int old_last_bin) {
+    view* v = cb_info->outputs[output].view;
+    unsigned int first_bin, last_bin;
+    view_data_range(v, &first_bin, &last_bin);
+    if (cb_info->feed && output == 0) {
+        unsigned int num_points;
+        real_t min, max;
+        output_values(view_output(v, 0), &num_points, &min, &max);
+        if (first_bin != old_first_bin || last_bin != old_last_bin || (feed_max_points(cb_info) && num_points > feed_max_points(cb_info))) {
+            return 0;
+        }
+    }
+    return computes_data_range(cb_info, v);
+}
+
+static void reload_views(cb_info_t* cb_info) {
+    FILE* file = fopen(cb_info->config_path, "r");
+    if (!file) {
+        fprintf(stderr, "Cannot read %s: %s\n", cb_info->config_path, strerror(errno));
+        return;
+    }
+
+    char* line = NULL;
+    size_t size = 0;
+    unsigned int i = 0;
+    while (i < cb_info->n_outputs && getline(&line, &size, file) >= 0) {
+        char* options = line + strspn(line, " \t\r\n");
+        if (!*options || *options == '#') {
+            continue;
+        }
+        view* v = cb_info->outputs[i++].view;
+        view_config config = cb_info->options;
+        if (view_config_parse(&config, options) || config.start_freq >= config.end_freq || config.num_points > FANOUT_MAX_FRAME) {
+            fprintf(stderr, "%s: invalid options for view %u, not changed\n", cb_info->config_path, i);
+            continue;
+        }
+        view_config old_config = *view_get_config(v);
+        unsigned int old_first_bin, old_last_bin;
+        view_data_range(v, &old_first_bin, &old_last_bin);
+        if (reconfigure_output(cb_info, v, &config)) {
+            fprintf(stderr, "%s: out of memory for view %u, not changed\n", cb_info->config_path, i);
+        } else if (!reload_fits(cb_info, i - 1, old_first_bin, old_last_bin)) {
+            view_reconfigure(v, &old_config);
+            fprintf(stderr, "%s: frequency range of view %u is fixed (-E fft, without -S, allows it) or it has more columns than -S, not changed\n", cb_info->config_path, i);
+        }
+    }
+    free(line);
+    fclose(file);
+
+    if (cb_info->server) {
+        cb_info->server->defaults = *view_get_config(cb_info->outputs[0].view);
+    }
+    update_data_range(cb_info);
+}
+
+// With --auto-width, on start and on every SIGWINCH. The displayed range
+// does not depend on the columns, so only the grouping tables are rebuilt
+static void fit_to_terminal(cb_info_t* cb_info) {
+    struct winsize size;
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &size) < 0 || !size.ws_col) {
+        return; // Not a terminal, -b is kept
+    }
+    for (unsigned int i = 0; i < cb_info->n_outputs; ++i) {
+        view* v = cb_info->outputs[i].view;
+        if (cb_info->outputs[i].fd >= 0) {
+            continue;
+        }
+        view_config config = *view_get_config(v);
+        config.num_points = view_points_for_width(v, size.ws_col);
+        if (i == 0 && feed_max_points(cb_info) && config.num_points > feed_max_points(cb_info)) {
+            config.num_points = feed_max_points(cb_info); // Narrower, -S has no room for more
+        }
+        reconfigure_output(cb_info, v, &config); // Or the previous width
+    }
+}
+/////////////////
+
+// DSP LOOP /////
+// Consumes the samples pushed by the capture thread, the only place where
+// processing and output happens, so a slow terminal never blocks capture
+// Render ticks come from a timerfd, only armed while there is something new
+void set_render_timer(int timer_fd, unsigned int fps, int armed) {
+    struct itimerspec spec = {0};
+    if (armed) {
+        long period_ns = 1000000000L / fps;
+        spec.it_interval.tv_sec = period_ns / 1000000000L;
+        spec.it_interval.tv_nsec = period_ns % 1000000000L;
+        spec.it_value = spec.it_interval;
+    }
+    timerfd_settime(timer_fd, 0, &spec, NULL);
+}
+
+void run_dsp_loop(spsc_ring* ring, pa_follow_sink* sink, sliding_window* window, cb_info_t* cb_info) {
+    struct pollfd pfd[4] = {
+        {.fd = spsc_ring_fd(ring), .events = POLLIN},
+        {.fd = -1, .events = POLLIN},
+        {.fd = cb_info->server ? fanout_fd(cb_info->server->fanout) : -1, .events = POLLIN},
+        {.fd = cb_info->signal_fd, .events = POLLIN},
+    };
+    ingest_level level;
+    ingest_level_reset(&level);
+    size_t frame_size = cb_info->sample_size * cb_info->channels;
+    int timer_armed = 0;
+    int idle = 0;
+
+    if (cb_info->fps) {
+        pfd[1].fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    }
+
+    while (!spsc_ring_closed(ring)) {
+        // Armed before every wait, whatever left a frame pending (a timeout too)
+        if (cb_info->fps && !timer_armed && cb_info->pending != PENDING_NONE) {
+            set_render_timer(pfd[1].fd, cb_info->fps, timer_armed = 1);
+        }
+
+        // Without data for a while (no sink running), display silence.
+        // While idle there are no wakeups at all until the capture resumes
+        int ready = poll(pfd, 4, idle ? -1 : (int) cb_info->no_sound_wait_time_ms);
+        if (cb_info->latency) {
+            // Every wakeup, frames that are not written still dump
+            latency_maybe_dump(cb_info->latency, latency_now());
+        }
+        if (ready == 0) {
+            idle = process_data_from_pa(NULL, 1, cb_info);
+            if (idle) {
+                pa_follow_sink_idle(sink);
+            }
+            continue;
+        }
+
+        if (pfd[2].revents & POLLIN) {
+            fanout_handle(cb_info->server->fanout);
+            if (cb_info->server->joined && idle) {
+                // Nothing else is going to be rendered until there's sound
+                cb_info->pending = PENDING_SILENCE;
+                render_output(cb_info);
+            }
+            cb_info->server->joined = 0;
+        }
+        if (pfd[3].revents & POLLIN) {
+            // Several signals of a kind are handled once
+            int reload = 0, resize = 0;
+            struct signalfd_siginfo info;
+            while (read(pfd[3].fd, &info, sizeof info) > 0) {
+                reload |= info.ssi_signo == SIGHUP;
+                resize |= info.ssi_signo == SIGWINCH;
+            }
+            if (reload) {
+                reload_views(cb_info);
+            }
+            if (cb_info->auto_width && (resize || reload)) {
+                fit_to_terminal(cb_info); // Reloaded -b are overridden too
+            }
+            if (idle) {
+                cb_info->pending = PENDING_SILENCE;
+                render_output(cb_info);
+            }
+        }
+        if (pfd[1].revents & POLLIN) {
+            uint64_t expirations;
+            if (read(pfd[1].fd, &expirations, sizeof expirations) > 0 && !render_output(cb_info)) {
+                // Nothing new since last tick, stop ticking
+                set_render_timer(pfd[1].fd, cb_info->fps, timer_armed = 0);
+            }
+        }
+        if (!(pfd[0].revents & POLLIN)) {
+            continue;
+        }
+        spsc_ring_clear_fd(ring);
+        if (cb_info->latency) {
+            cb_info->pushed_ns = spsc_ring_push_time(ring);
+            latency_record(cb_info->latency, LATENCY_CAPTURE, cb_info->pushed_ns, latency_now());
+        }
+
+        size_t length;
+        const unsigned char* pa_buffer;
+        while ((pa_buffer = spsc_ring_peek(ring, &length)) && length) {
+            length /= frame_size;
+            size_t consumed = 0;
+            if (idle) {
+                // Woken up by the peak stream: the wait for silence starts
+                // over, the time asleep does not count
+                cb_info->time_without_sound = 0;
+                clock_gettime(CLOCK_MONOTONIC_RAW, &cb_info->last_update);
+            }
+            idle = 0;
+
+            while (consumed < length && !idle) {
+                unsigned int available;
+                real_t* amplitude_samples = sliding_window_write_ptr(window, &available);
+                // Frames taken from the ring, without decimation it's a frame per window sample
+                size_t frames = cb_info->decimators ? decimator_input_needed(cb_info->decimators[0], available) : available;
+                if (frames > length - consumed) {
+                    frames = length - consumed;
+                }
+                const unsigned char* src = pa_buffer + consumed * frame_size;
+
+                if (cb_info->decimators) {
+                    // Decimators read the interleaved frames directly
+                    ingest_samples(cb_info->capture_format, src, cb_info->interleaved, frames * cb_info->channels, &level);
+                    for (unsigned int c = 0; c < cb_info->channels; ++c) {
+                        available = decimator_process(cb_info->decimators[c], cb_info->interleaved + c, cb_info->channels, frames, amplitude_samples + c * cb_info->channel_stride);
+                    }
+                } else if (cb_info->channels == 1) {
+                    available = frames;
+                    ingest_samples(cb_info->capture_format, src, amplitude_samples, available, &level);
+                } else {
+                    available = frames;
+                    ingest_samples(cb_info->capture_format, src, cb_info->interleaved, available * cb_info->channels, &level);
+                    ingest_deinterleave(cb_info->interleaved, amplitude_samples, cb_info->channel_stride, cb_info->channels, available);
+                }
+                consumed += frames;
+
+                if (cb_info->sparse) {
+                    const real_t* outgoing = sliding_window_outgoing(window);
+                    for (unsigned int c = 0; c < cb_info->channels; ++c) {
+                        unsigned int offset = c * cb_info->channel_stride;
+                        sparse_dft_update(cb_info->sparse[c], amplitude_samples + offset, outgoing + offset, available);
+                    }
+                }
+                for (unsigned int c = 0; cb_info->multires && c < cb_info->channels; ++c) {
+                    multires_update(cb_info->multires[c], amplitude_samples + c * cb_info->channel_stride, available);
+                }
+                real_t* window_samples = sliding_window_commit(window, available);
+                if (window_samples) {
+                    cb_info->level = level;
+                    idle = process_data_from_pa(window_samples, level.silence, cb_info);
+                    ingest_level_reset(&level);
+                }
+            }
+            spsc_ring_consume(ring, consumed * frame_size);
+
+            if (idle) {
+                // The stream gets corked, what is still in the ring is silence
+                pa_follow_sink_idle(sink);
+                spsc_ring_discard(ring);
+                sliding_window_reset(window);
+                for (unsigned int c = 0; cb_info->sparse && c < cb_info->channels; ++c) {
+                    sparse_dft_reset(cb_info->sparse[c]);
+                }
+                for (unsigned int c = 0; cb_info->multires && c < cb_info->channels; ++c) {
+                    multires_reset(cb_info->multires[c]);
+                }
+                for (unsigned int c = 0; cb_info->decimators && c < cb_info->channels; ++c) {
+                    decimator_reset(cb_info->decimators[c]);
+                }
+                break;
+            }
+        }
+    }
+
+    if (pfd[1].fd >= 0) {
+        close(pfd[1].fd);
+    }
+}
+/////////////////
+
+// CLIENT ///////
+// Displays what a --serve instance renders with these options, nothing is
+// captured nor transformed here
+int run_client(const char* path, const view_config* options, char new_line_char) {
+    char request[FANOUT_MAX_REQUEST];
+    view_config_format(options, request, sizeof request);
+    int fd = fanout_connect(path, request);
+    if (fd < 0) {
+        fprintf(stderr, "Cannot connect to %s: %s\n", path, strerror(errno));
+        return 1;
+    }
+
+    char* frame = (char*) malloc(1 + FANOUT_MAX_FRAME);
+    if (!frame) {
+        close(fd);
+        return 1;
+    }
+    frame[0] = new_line_char;
+    size_t error_length = strlen(FANOUT_ERROR);
+    int ret = 0;
+    for (;;) {
+        ssize_t length = recv(fd, frame + 1, FANOUT_MAX_FRAME, 0);
+        if (length < 0 && errno == EINTR) {
+            continue;
+        }
+        if (length <= 0) {
+            break;
+        }
+        if ((size_t) length >= error_length && memcmp(frame + 1, FANOUT_ERROR, error_length) == 0) {
+            fprintf(stderr, "%.*s\n", (int) length, frame + 1);
+            ret = 1;
+            break;
+        }
+        write_all(STDOUT_FILENO, frame, length + 1);
+    }
+    free(frame);
+    close(fd);
+    return ret;
+}
+/////////////////
+
 
 int main(int argc, char **argv) {
-    timeSinceLastUpdate();
 
     int n_samples = 1024; // n
+    int hop_samples = 0; // H - 0 means n_samples, no overlap
+    int rigor = FFT_RIGOR_MEASURE; // P
     int sample_rate = 44100; // r
-    int start_freq = 200; // f
-    int end_freq = 2000;  // F // Not 4k because with low freq spikes it's difficult to see high freq ones
+    int capture_format = INGEST_FLOAT32LE; // C
+    int channels = 1; // N
 
     int stats = 0; // s - print stats
 
     int no_sound_wait_time_ms = 3000;  // w - 3s without sound -> go to sleep
-    int no_sound_sleep_time_ms = 5000; // W - Wake up every 5 seconds to check if there's sound
+    int no_sound_probe_time_ms = 250;  // W - While sleeping, check 4 times per second if there's sound
 
-    int num_points = 30; // b
-    int charset = OUTPUT_CHARSET_BARS; // c
-    int grouping = OUTPUT_NO_GROUPING; // g
-    int group_func = OUTPUT_MAX_GROUPING_FUNC; // G
+    view_config view_options; // b c f F g G m o i
+    view_config_defaults(&view_options);
     int transform = OUTPUT_NO_TRANSFORM; // t
-    int smoothing = OUTPUT_EXP2_SMOOTH; // m
-    double smooth_value_factor = .25;
-    double smooth_limit_factor = .2;
-    double lineal_scaling_factor_offset = .8; // o
-    double sigmoid_scaling_factor = 0; // i
     char new_line_char = '\r'; // l
+    int fps = 60; // R - 0 renders every FFT
+    char* input_path = NULL; // I - offline analysis of a file
+    int threads = 0; // j - 0 is one per CPU
+    int raw_output = 0; // O
+    int scaling = 0; // J - with -I, only measure the throughput per thread count
+    int latency_fd = -1; // L - latency histograms are dumped here
+    int low_latency = 0; // Q
+    int engine = ENGINE_AUTO; // E
+    int decimate = 0; // D
+    char* shm_name = NULL; // S - publish frames in shared memory
+    int shm_content = SHM_FEED_POINTS | SHM_FEED_SPECTRUM; // X
+    char* serve_path = NULL; // U - serve views to the clients of this socket
+    char* connect_path = NULL; // u - display a view served by another instance
+    char** view_specs = NULL; // V - more views of the same spectrum, [fd:]options
+    int n_view_specs = 0;
+    char* config_path = NULL; // K - view options reloaded on SIGHUP
+    int auto_width = 0; // A - stdout rows follow the terminal width
+
+    static struct option long_options[] = {
+        {"fps", required_argument, NULL, 'R'},
+        {"planner", required_argument, NULL, 'P'},
+        {"capture-format", required_argument, NULL, 'C'},
+        {"channels", required_argument, NULL, 'N'},
+        {"input", required_argument, NULL, 'I'},
+        {"jobs", required_argument, NULL, 'j'},
+        {"raw", no_argument, NULL, 'O'},
+        {"scaling", no_argument, NULL, 'J'},
+        {"latency", required_argument, NULL, 'L'},
+        {"low-latency", no_argument, NULL, 'Q'},
+        {"engine", required_argument, NULL, 'E'},
+        {"decimate", no_argument, NULL, 'D'},
+        {"shm", required_argument, NULL, 'S'},
+        {"shm-content", required_argument, NULL, 'X'},
+        {"serve", required_argument, NULL, 'U'},
+        {"connect", required_argument, NULL, 'u'},
+        {"view", required_argument, NULL, 'V'},
+        {"config", required_argument, NULL, 'K'},
+        {"auto-width", no_argument, NULL, 'A'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
 
-    char c;
-    while ((c = getopt(argc, argv, "n:r:f:F:sw:W:b:c:g:G:t:m:o:i:hl")) != -1) {
+    int c;
+    while ((c = getopt_long(argc, argv, "n:H:P:r:C:N:f:F:sw:W:b:c:g:G:t:m:o:i:hlR:I:j:OJL:QE:DS:X:U:u:V:K:A", long_options, NULL)) != -1) {
         switch (c) {
             case 'n':
                 n_samples = atoi_exit_if_invalid(optarg, 'n');
                 break;
+            case 'H':
+                hop_samples = atoi_zero_exit_if_invalid(optarg, 'H');
+                break;
+            case 'P':
+                rigor = find_string_var(optarg, 'P', rigor_string2value, sizeof(rigor_string2value) / sizeof(var));
+                break;
             case 'r':
                 sample_rate = atoi_exit_if_invalid(optarg, 'r');
                 break;
-            case 'f':
-                start_freq = atoi_exit_if_invalid(optarg, 'f');
+            case 'C':
+                capture_format = find_string_var(optarg, 'C', capture_string2value, sizeof(capture_string2value) / sizeof(var));
                 break;
-            case 'F':
-                end_freq = atoi_exit_if_invalid(optarg, 'F');
+            case 'N':
+                channels = atoi_exit_if_invalid(optarg, 'N');
+                if (channels < 1 || channels > PA_CHANNELS_MAX) {
+                    fprintf(stderr, "Option `-N' has invalid value <%s>\n", optarg);
+                    exit(1);
+                }
                 break;
             case 's':
                 stats = 1;
@@ -230,136 +1089,462 @@ int main(int argc, char **argv) {
                 no_sound_wait_time_ms = atoi_exit_if_invalid(optarg, 'w');
                 break;
             case 'W':
-                no_sound_sleep_time_ms = atoi_exit_if_invalid(optarg, 'W');
+                no_sound_probe_time_ms = atoi_exit_if_invalid(optarg, 'W');
+                if (no_sound_probe_time_ms < 1 || no_sound_probe_time_ms > 1000) {
+                    // The peak stream cannot go below 1 Hz
+                    fprintf(stderr, "Option `-W' has invalid value <%s>\n", optarg);
+                    exit(1);
+                }
                 break;
             case 'b':
-                num_points = atoi_exit_if_invalid(optarg, 'b');
-                break;
             case 'c':
-                charset = find_string_var(optarg, 'c', charset_string2value, sizeof(charset_string2value) / sizeof(var));
-                break;
+            case 'f':
+            case 'F':
             case 'g':
-                grouping = find_string_var(optarg, 'g', grouping_string2value, sizeof(grouping_string2value) / sizeof(var));
-                break;
             case 'G':
-                group_func = find_string_var(optarg, 'G', groupingfunc_string2value, sizeof(groupingfunc_string2value) / sizeof(var));
+            case 'm':
+            case 'o':
+            case 'i':
+                if (view_config_set(&view_options, c, optarg)) {
+                    fprintf(stderr, "Option `-%c' has invalid value <%s>\n", c, optarg);
+                    exit(1);
+                }
                 break;
             case 't':
                 transform = find_string_var(optarg, 't', transform_string2value, sizeof(transform_string2value) / sizeof(var));
                 break;
-            case 'm':
-                smoothing = find_string_var(optarg, 'm', smoothing_string2value, sizeof(smoothing_string2value) / sizeof(var));
+            case 'l':
+                new_line_char = '\n';
                 break;
-            case 'o':
-                lineal_scaling_factor_offset = atof_exit_if_invalid(optarg, 'o');
+            case 'R':
+                fps = atoi_zero_exit_if_invalid(optarg, 'R');
                 break;
-            case 'i':
-                sigmoid_scaling_factor = atof_exit_if_invalid(optarg, 'i');
+            case 'I':
+                input_path = optarg;
                 break;
-            case 'l':
-                new_line_char = '\n';
+            case 'j':
+                threads = atoi_zero_exit_if_invalid(optarg, 'j');
+                break;
+            case 'O':
+                raw_output = 1;
+                break;
+            case 'J':
+                scaling = 1;
+                break;
+            case 'L':
+                latency_fd = atoi_zero_exit_if_invalid(optarg, 'L');
+                if (latency_fd < STDERR_FILENO) {
+                    // Not stdin, nor stdout where the rows are written
+                    fprintf(stderr, "Option `-L' has invalid value <%s>\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'Q':
+                low_latency = 1;
+                break;
+            case 'E':
+                engine = find_string_var(optarg, 'E', engine_string2value, sizeof(engine_string2value) / sizeof(var));
+                break;
+            case 'D':
+                decimate = 1;
+                break;
+            case 'S':
+                shm_name = optarg;
+                break;
+            case 'X':
+                shm_content = find_string_var(optarg, 'X', shm_content_string2value, sizeof(shm_content_string2value) / sizeof(var));
+                break;
+            case 'U':
+                serve_path = optarg;
+                break;
+            case 'u':
+                connect_path = optarg;
+                break;
+            case 'V':
+                view_specs = (char**) realloc(view_specs, sizeof(char*) * (n_view_specs + 1));
+                view_specs[n_view_specs++] = optarg;
+                break;
+            case 'K':
+                config_path = optarg;
+                break;
+            case 'A':
+                auto_width = 1;
                 break;
             case 'h':
                 fprintf(stderr, "Available options:\n");
                 fprintf(stderr, "-s: Show stats\n");
                 fprintf(stderr, "-l: Use \\n as newline character\n");
-                fprintf(stderr, "-b <%i>: Number of columns, only used if values are grouped\n", num_points);
+                fprintf(stderr, "-R, --fps <%i>: Max output lines per second, newest data is always shown (0 is one per FFT)\n", fps);
+                fprintf(stderr, "-b <%u>: Number of columns, only used if values are grouped\n", view_options.num_points);
                 fprintf(stderr, "-c <bars>: Charset used to display values [bars, braille, wide_braille]\n");
                 fprintf(stderr, "-g <none>: Grouping of values, none, lineal or logaritmic [none, lineal, log]\n");
                 fprintf(stderr, "-G <none>: When grouping two or more values, how to do it [none, max, avg]\n");
                 fprintf(stderr, "-t <none>: Transform values, either apply logaritmic function or not [none, log]\n");
                 fprintf(stderr, "-m <exp2>: Smoothing [none, exp2]\n");
-                fprintf(stderr, "-o <%f>: Apply lineal scaling factor offset\n", lineal_scaling_factor_offset);
-                fprintf(stderr, "-i <%f>: Apply sigmoid function with factor (0 is disabled)\n", sigmoid_scaling_factor);
+                fprintf(stderr, "-o <%f>: Apply lineal scaling factor offset\n", view_options.lineal_scaling_factor_offset);
+                fprintf(stderr, "-i <%f>: Apply sigmoid function with factor (0 is disabled)\n", view_options.sigmoid_scaling_factor);
+                fprintf(stderr, "-L, --latency <fd>: Every second, write per stage latency percentiles to fd (2 is stderr, 0 and 1 are not allowed)\n");
+                fprintf(stderr, "-V, --view <[fd:]options>: One more view of the same spectrum, the options (-b -c -f -F -g -G -m -o -i) override the rest of the command line. A row below the others, or written to fd\n");
+                fprintf(stderr, "-A, --auto-width: The rows fill the terminal width, following its resizes, instead of -b (with -g lineal or log)\n");
+                fprintf(stderr, "-K, --config <file>: On SIGHUP, read the view options (-b -c -f -F -g -G -m -o -i) from file, a line per view: the command line one, then the -V ones. Lines override the command line, # are comments\n");
+                fprintf(stderr, "-S, --shm <name>: Also publish every frame in the shared memory ring /dev/shm/<name> (layout in shm_feed.h)\n");
+                fprintf(stderr, "-X, --shm-content <both>: What -S publishes, grouped and smoothed points and/or the displayed spectrum [both, points, spectrum]\n");
                 fprintf(stderr, "-h: Show this help\n");
                 fprintf(stderr, "Sleep options:\n");
                 fprintf(stderr, "-w <%i>: After this time (ms), if no sound, the program goes to sleep\n", no_sound_wait_time_ms);
-                fprintf(stderr, "-W <%i>: Wake up every X time to check if there's sound playing\n", no_sound_sleep_time_ms);
+                fprintf(stderr, "-W <%i>: While sleeping (stream corked), check every X ms (up to 1000) if there's sound playing\n", no_sound_probe_time_ms);
                 fprintf(stderr, "Audio options:\n");
-                fprintf(stderr, "-n <%i>: Audio buffer size\n", n_samples);
+                fprintf(stderr, "-n <%i>: Audio buffer size (FFT window)\n", n_samples);
+                fprintf(stderr, "-H <%i>: New samples between FFTs, less than -n to overlap windows (0 is -n)\n", hop_samples);
+                fprintf(stderr, "-P, --planner <measure>: FFTW planner rigor, plans are cached [estimate, measure, patient, exhaustive]\n");
+                fprintf(stderr, "-Q, --low-latency: Ask PA for fragments of a hop or a frame (-R), the smaller, instead of the server default\n");
+                fprintf(stderr, "-E, --engine <auto>: Full FFT per hop, sliding DFT of the displayed bins per sample, or octave pyramid of small FFTs (auto with -g log) [auto, fft, sparse, multires]\n");
                 fprintf(stderr, "-r <%i>: Audio sample rate\n", sample_rate);
-                fprintf(stderr, "-f <%i>: min frequency\n", start_freq);
-                fprintf(stderr, "-F <%i>: max frequency\n", end_freq);
+                fprintf(stderr, "-D, --decimate: Low pass and downsample the capture as much as -F allows, -n and -H are then decimated samples\n");
+                fprintf(stderr, "-C, --capture-format <f32>: Sample format requested to PA, f32 needs no conversion [f32, s16]\n");
+                fprintf(stderr, "-N, --channels <%i>: Channels to capture, one spectrum each (stereo is drawn mirrored, left to the left)\n", channels);
+                fprintf(stderr, "-f <%u>: min frequency\n", view_options.start_freq);
+                fprintf(stderr, "-F <%u>: max frequency\n", view_options.end_freq);
+                fprintf(stderr, "Offline options:\n");
+                fprintf(stderr, "-I, --input <file>: Analyze a WAV (or raw PCM as per -r, -C, -N) file instead of PA, one line per window\n");
+                fprintf(stderr, "-j, --jobs <%i>: Worker threads for -I (0 is one per CPU)\n", threads);
+                fprintf(stderr, "-O, --raw: With -I, write raw magnitude frames (n/2+1 native floats per window) instead of lines\n");
+                fprintf(stderr, "-J, --scaling: With -I, write nothing and report the throughput with 1, 2, 4... up to -j threads\n");
+                fprintf(stderr, "Server options:\n");
+                fprintf(stderr, "-U, --serve <path>: Capture once for the clients of the Unix socket at path, each one with its own -b -c -f -F -g -G -m -o -i (the rest are shared), instead of writing to stdout\n");
+                fprintf(stderr, "-u, --connect <path>: Display the spectrum captured by a --serve instance, with these -b -c -f -F -g -G -m -o -i and -l\n");
                 return 0;
         }
     }
 
 
-    //// Init fftw
-    double* amplitude_samples = (double*) fftw_malloc(sizeof(double) * n_samples);
-    fftw_complex* fftw_out = (fftw_complex*) fftw_malloc(sizeof(fftw_complex) * n_samples);
-    fftw_plan plan = fftw_plan_dft_r2c_1d(n_samples, amplitude_samples, fftw_out, FFTW_MEASURE | FFTW_DESTROY_INPUT);
-    int n_out_values = n_samples/2 +1;
+    if (connect_path) {
+        return run_client(connect_path, &view_options, new_line_char);
+    }
+
+    offline_input* input = NULL;
+    if (input_path) {
+        if (!(input = offline_open(input_path, capture_format, channels, sample_rate))) {
+            return 1;
+        }
+        sample_rate = offline_sample_rate(input);
+        channels = 1; // Downmixed
+    }
+
+    // -V views start from the command line options, only the live capture
+    // is displayed locally by more than one
+    int n_outputs = (input || serve_path) ? 1 : 1 + n_view_specs;
+    view_config* output_options = (view_config*) malloc(sizeof(view_config) * n_outputs);
+    int* output_fds = (int*) malloc(sizeof(int) * n_outputs);
+    unsigned int start_freq = view_options.start_freq;
+    unsigned int end_freq = view_options.end_freq;
+    for (int i = 0; i < n_outputs; ++i) {
+        output_options[i] = view_options;
+        output_fds[i] = -1;
+        if (!i) {
+            continue;
+        }
+        char* options = view_specs[i - 1];
+        char* end;
+        long fd = strtol(options, &end, 10);
+        if (end != options && *end == ':') {
+            output_fds[i] = fd;
+            options = end + 1;
+        }
+        if (view_config_parse(output_options + i, options) || output_fds[i] < -1) {
+            fprintf(stderr, "Option `-V' has invalid value <%s>\n", view_specs[i - 1]);
+            exit(1);
+        }
+        // The spectrum has to cover every view
+        start_freq = (output_options[i].start_freq < start_freq) ? output_options[i].start_freq : start_freq;
+        end_freq = (output_options[i].end_freq > end_freq) ? output_options[i].end_freq : end_freq;
+    }
+    free(view_specs);
 
+    // Only the live capture is decimated, the FFT sees the effective rate
+    unsigned int decimation = (decimate && !input) ? decimator_factor_for(sample_rate, end_freq) : 1;
+    double effective_rate = ((double) sample_rate) / decimation;
+
+    // Clients may display any range, the full FFT has every bin
+    if (engine == ENGINE_AUTO && serve_path) {
+        engine = ENGINE_FFT;
+    }
+    // Logarithmic columns get constant-Q resolution from an octave pyramid:
+    // n_samples is the resolution of the lowest octave, not an FFT size
+    if (engine == ENGINE_AUTO && view_options.grouping == OUTPUT_LOGARITMIC_GROUPING && !input) {
+        engine = ENGINE_MULTIRES;
+    }
+    multires** pyramids = NULL;
+    if (engine == ENGINE_MULTIRES && !input) {
+        pyramids = (multires**) malloc(sizeof(multires*) * channels);
+        for (int c = 0; c < channels; ++c) {
+            if (!(pyramids[c] = multires_init(n_samples, effective_rate, start_freq, end_freq, rigor))) {
+                fprintf(stderr, "Not enough memory for the octave pyramid\n");
+                exit(1);
+            }
+        }
+    }
 
     ///// Output freq
-    double step_freq = ((double) sample_rate) / n_samples;
+    int n_out_values = pyramids ? multires_length(pyramids[0]) : n_samples/2 +1;
+    double step_freq = effective_rate / n_samples;
     // Freq = k * samples_per_second / buffer_size
     double* graph_freq = (double*) malloc(sizeof(double) * n_out_values);
     for (int i = 0; i < n_out_values; ++i) {
-        graph_freq[i] = step_freq * i;
+        graph_freq[i] = pyramids ? multires_frequencies(pyramids[0])[i] : step_freq * i;
     }
 #ifdef DEBUG
-    for (int i = 1; i < 41; ++i) {
+    for (int i = 1; i < 41 && i < n_out_values; ++i) {
         fprintf(stderr, "%4.0f ", graph_freq[i]);
     }
     fprintf(stderr,  "<\n");
 #endif
 
+    //// Print init
+    // Each channel of each view has its own smoothing and limits
+    local_output* outputs = (local_output*) calloc(n_outputs, sizeof(local_output));
+    unsigned int n_rows = 0;
+    size_t rows_max_length = 0;
+    for (int i = 0; i < n_outputs; ++i) {
+        local_output* output = outputs + i;
+        output->view = view_init(output_options + i, n_out_values, graph_freq, channels, transform);
+        output->fd = output_fds[i];
+        size_t line_max_length = view_line_max_length(output->view);
+        if (output->fd < 0) {
+            n_rows++;
+            rows_max_length += line_max_length + 4; // Separator and clear to the end
+        } else {
+            output->frame = (char*) malloc(1 + line_max_length);
+            output->last_line = (char*) malloc(line_max_length);
+            output->line_size = line_max_length;
+        }
+    }
+    free(output_options);
+    free(output_fds);
+    view* main_view = outputs[0].view;
 
-    //// Output buffers
-    double* graph = (double*) malloc(sizeof(double) * n_out_values);
-    double* empty_graph = (double*) calloc(n_out_values, sizeof(double));
+    if (input) {
+        int ret = 0;
+        if (scaling) {
+            offline_scaling(input, n_samples, hop_samples, threads, rigor);
+        } else {
+            ret = offline_run(input, n_samples, hop_samples, threads, rigor, raw_output ? NULL : view_output(main_view, 0), stdout);
+        }
+        offline_close(input);
+        view_deinit(main_view);
+        free(outputs);
+        free(graph_freq);
+        return ret;
+    }
 
-    //// Print init
-    output_context* out_ctx = output_init(
-            n_out_values, // unsigned int data_length,
-            graph_freq,   // double* data_frequency,
-            start_freq,   // unsigned int min_freq,
-            end_freq,     // unsigned int max_freq,
-            num_points,   // unsigned int num_points,
-            0,            // double abs_min,
-            100000000,    // double abs_max,
-            grouping,     // int grouping,
-            group_func,   // int group_func,
-            transform     // int transform flags
-            );
-    output_set_silence_str(out_ctx, L"No \u266C "); // No ♬ */
-    output_set_smoothing(out_ctx, smoothing);
-    output_set_smoothing_factors(out_ctx, smooth_value_factor, smooth_limit_factor);
-    output_set_lineal_scale_factor_offset(out_ctx, lineal_scaling_factor_offset);
-    if (sigmoid_scaling_factor > 0) {
-        output_set_sigmoid_scale_factor(out_ctx, sigmoid_scaling_factor);
-    }
-    output_set_charset(out_ctx, charset);
+    //// Init fftw
+    // The window moves along the ring buffer, the plan is executed with
+    // different (unaligned) input pointers and the input must be preserved.
+    // Channels are transformed at once, one window every channel_stride values
+    sliding_window* window = sliding_window_init(n_samples, hop_samples, channels);
+    unsigned int channel_stride = sliding_window_channel_stride(window);
+    fft_complex* fftw_out = NULL;
+    fft_plan plan = NULL;
+
+    // Narrow ranges with short hops are cheaper bin by bin, only what's displayed
+    unsigned int first_bin = 1, last_bin = 0;
+    for (int i = 0; i < n_outputs; ++i) {
+        add_data_range(outputs[i].view, &first_bin, &last_bin);
+    }
+    if (engine == ENGINE_AUTO && first_bin <= last_bin) {
+        engine = sparse_dft_is_cheaper(n_samples, hop_samples ? hop_samples : n_samples, first_bin, last_bin) ? ENGINE_SPARSE : ENGINE_FFT;
+    }
+    sparse_dft** sparse = NULL;
+    if (engine == ENGINE_SPARSE && first_bin <= last_bin) {
+        sparse = (sparse_dft**) malloc(sizeof(sparse_dft*) * channels);
+        for (int c = 0; c < channels; ++c) {
+            sparse[c] = sparse_dft_init(n_samples, first_bin, last_bin);
+        }
+    } else if (!pyramids) {
+        fftw_out = (fft_complex*) FFTW(malloc)(sizeof(fft_complex) * n_out_values * channels);
+        plan = fft_plan_r2c_many(n_samples, channels, sliding_window_buffer(window), channel_stride, fftw_out, n_out_values, rigor, FFTW_UNALIGNED | FFTW_PRESERVE_INPUT);
+        sliding_window_reset(window); // Planning may overwrite the input
+    }
+    // The log is done once for every view, with the FFT it's fused with the
+    // magnitude: log|X| = log|X|^2 / 2, the sqrt is skipped
+    for (int i = 0; (transform & OUTPUT_LOGARITMIC_TRANSFORM) && i < n_outputs; ++i) {
+        view_set_log_input(outputs[i].view, 1);
+    }
+
+    //// Output buffers
+    real_t* graph = (real_t*) calloc(n_out_values * channels, sizeof(real_t));
+    real_t* empty_graph = (real_t*) calloc(n_out_values, sizeof(real_t));
+    real_t* interleaved = (channels > 1 || decimation > 1) ? (real_t*) malloc(sizeof(real_t) * n_samples * channels * decimation) : NULL;
+    decimator** decimators = NULL;
+    if (decimation > 1) {
+        decimators = (decimator**) malloc(sizeof(decimator*) * channels);
+        for (int c = 0; c < channels; ++c) {
+            decimators[c] = decimator_init(decimation);
+        }
+    }
 
     cb_info_t cb_info = {
         .time_without_sound = 0.0F,
         .no_sound_wait_time_ms = no_sound_wait_time_ms,
-        .no_sound_sleep_time_ms = no_sound_sleep_time_ms,
 
         .fftw_out = fftw_out,
         .plan = plan,
+        .sparse = sparse,
+        .multires = pyramids,
         .n_out_values = n_out_values,
+        .n_samples = n_samples,
 
         .graph = graph,
         .empty_graph = empty_graph,
 
         .new_line_char = new_line_char,
         .stats = stats,
-        .out_ctx = out_ctx,
+        .channels = channels,
+        .channel_stride = channel_stride,
+        .interleaved = interleaved,
+        .decimators = decimators,
+        .effective_rate = effective_rate,
+        .outputs = outputs,
+        .n_outputs = n_outputs,
+        .n_rows = n_rows,
+        .capture_format = capture_format,
+        .sample_size = ingest_sample_size(capture_format),
+        .magnitude_scale = (capture_format == INGEST_FLOAT32LE) ? 32768 : 1,
+        .first_bin = first_bin,
+        .n_bins = (first_bin <= last_bin) ? last_bin - first_bin + 1 : 0,
+        .log_magnitude = transform & OUTPUT_LOGARITMIC_TRANSFORM,
+        .options = view_options,
+        .config_path = config_path,
+        .auto_width = auto_width && !serve_path,
+        .signal_fd = -1,
+
+        .fps = fps,
+        .pending = PENDING_NONE,
+        .frame_size = FRAME_PREFIX + rows_max_length + 128,
     };
+    for (int i = 0; cb_info.log_magnitude && i < n_out_values; ++i) {
+        empty_graph[i] = -INFINITY; // Silence, as a log magnitude
+    }
+    cb_info.frame = malloc(cb_info.frame_size);
+    cb_info.last_line = malloc(cb_info.frame_size);
+    cb_info.last_line_length = 0;
+    if (cb_info.auto_width) {
+        fit_to_terminal(&cb_info); // Before the shm feed takes the number of points
+    }
+    clock_gettime(CLOCK_MONOTONIC_RAW, &cb_info.last_update);
+    cb_info.last_render = cb_info.last_update;
+    cb_info.latency = (latency_fd >= 0) ? latency_init(latency_fd, 1000) : NULL;
+    if (shm_name) {
+        unsigned int num_points_max = 0;
+        for (int c = 0; c < channels; ++c) {
+            unsigned int num_points;
+            real_t min, max;
+            output_values(view_output(main_view, c), &num_points, &min, &max);
+            if (num_points > num_points_max) {
+                num_points_max = num_points;
+            }
+        }
+        int flags = shm_content | ((transform & OUTPUT_LOGARITMIC_TRANSFORM) ? SHM_FEED_LOG_SPECTRUM : 0);
+        unsigned int main_first_bin, main_last_bin;
+        view_data_range(main_view, &main_first_bin, &main_last_bin);
+        unsigned int main_n_bins = (main_first_bin <= main_last_bin) ? main_last_bin - main_first_bin + 1 : 0;
+        if (!(cb_info.feed = shm_feed_open(shm_name, flags, channels, num_points_max, main_n_bins, graph_freq + main_first_bin))) {
+            return 1;
+        }
+    }
+    if (serve_path && !(cb_info.server = server_init(serve_path, &view_options, graph_freq, transform, &cb_info))) {
+        return 1;
+    }
+
+    // SIGHUP and SIGWINCH are read from a signalfd by the DSP loop, they
+    // have to be blocked before the PA threads are created, they inherit the mask
+    if (config_path || cb_info.auto_width) {
+        sigset_t signals;
+        sigemptyset(&signals);
+        if (config_path) {
+            sigaddset(&signals, SIGHUP);
+        }
+        if (cb_info.auto_width) {
+            sigaddset(&signals, SIGWINCH);
+        }
+        pthread_sigmask(SIG_BLOCK, &signals, NULL);
+        cb_info.signal_fd = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+    }
 
     //// Set up PA
-    pa_set_up_read_callback(n_samples, sample_rate, amplitude_samples, process_data_from_pa, &cb_info);
+    // Room for a few windows, in case the terminal blocks the DSP thread.
+    // Windows are decimation times longer in captured frames
+    const pa_sample_spec sample_spec = {
+        .format = (capture_format == INGEST_FLOAT32LE) ? PA_SAMPLE_FLOAT32LE : PA_SAMPLE_S16LE,
+        .rate = sample_rate,
+        .channels = channels
+    };
+    spsc_ring* ring = spsc_ring_init(8 * n_samples * decimation, pa_frame_size(&sample_spec));
+    spsc_ring_set_timestamps(ring, cb_info.latency != NULL);
+    // Low latency: a fragment per hop, or per rendered frame if that's
+    // shorter, so the newest samples are always in the next line. 2 ms min
+    unsigned int fragment_samples = 0;
+    if (low_latency) {
+        fragment_samples = (hop_samples ? hop_samples : n_samples) * decimation;
+        if (fps && (unsigned int) (sample_rate / fps) < fragment_samples) {
+            fragment_samples = sample_rate / fps;
+        }
+        if (fragment_samples < (unsigned int) sample_rate / 500) {
+            fragment_samples = sample_rate / 500;
+        }
+    }
+    pa_follow_sink* sink = pa_follow_sink_start(n_samples * decimation, fragment_samples, &sample_spec, no_sound_probe_time_ms, ring);
+    cb_info.sink = sink;
+    cb_info.ring = ring;
+    if (sink) {
+        run_dsp_loop(ring, sink, window, &cb_info);
+        pa_follow_sink_stop(sink);
+    }
+    spsc_ring_deinit(ring);
 
     //// Free memory
-    output_deinit(out_ctx);
+    if (cb_info.latency) {
+        latency_dump(cb_info.latency);
+        latency_deinit(cb_info.latency);
+    }
+    if (cb_info.feed) {
+        shm_feed_close(cb_info.feed);
+    }
+    if (cb_info.server) {
+        server_deinit(cb_info.server);
+    }
+    if (cb_info.signal_fd >= 0) {
+        close(cb_info.signal_fd);
+    }
+    for (int i = 0; i < n_outputs; ++i) {
+        view_deinit(outputs[i].view);
+        free(outputs[i].frame);
+        free(outputs[i].last_line);
+    }
+    free(outputs);
+    free(interleaved);
+    for (int c = 0; decimators && c < channels; ++c) {
+        decimator_deinit(decimators[c]);
+    }
+    free(decimators);
+    free(cb_info.last_line);
+    free(cb_info.frame);
     free(empty_graph);
     free(graph);
     free(graph_freq);
-    fftw_free(fftw_out);
-    fftw_free(amplitude_samples);
+    if (plan) {
+        FFTW(destroy_plan)(plan);
+    }
+    FFTW(free)(fftw_out);
+    for (int c = 0; sparse && c < channels; ++c) {
+        sparse_dft_deinit(sparse[c]);
+    }
+    free(sparse);
+    for (int c = 0; pyramids && c < channels; ++c) {
+        multires_deinit(pyramids[c]);
+    }
+    free(pyramids);
+    sliding_window_deinit(window);
 
     return 0;
 }
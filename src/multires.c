@@ -0,0 +1,235 @@
+/*
+   This file is part of the 'term_pa_spectrum' program, which follows
+   a pulseaudio stream and displays its frequency spectrum through the
+   terminal.
+
+   Copyright (C) <2018> Jose Maria Perez Ramos
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.    See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.    If not, see <http://www.gnu.org/licenses/>.
+
+   Author: Jose Maria Perez Ramos <jose.m.perez.ramos+git gmail>
+   Date: 2018.08.13
+   Version: 1.0.0
+*/
+
+#include "multires.h"
+
+#include "decimator.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define MULTIRES_MIN_FFT 64U // 12.8 bins per octave
+
+typedef struct {
+    decimator* decimator;          // From the previous level, NULL for the first one
+    real_t* ring;                  // Last size samples, mirrored like sliding_window
+    unsigned int size;             // fft_size + the delay to the last level
+    unsigned int write_index;
+    unsigned int first_bin;        // Bins contributed to the virtual spectrum
+    unsigned int n_bins;
+    unsigned int offset;           // Position in the virtual spectrum
+} multires_level;
+
+struct multires {
+    unsigned int fft_size;
+    real_t gain;                   // To the scale of an n_samples FFT
+    unsigned int n_levels;
+    unsigned int first_level;      // Levels before this one are only decimated
+    multires_level* levels;
+    real_t* scratch;               // Decimated samples, in place down the pyramid
+    unsigned int scratch_size;
+    fft_plan plan;
+    fft_complex* fft_out;
+    double* frequencies;
+    unsigned int length;
+};
+
+multires* multires_init(unsigned int n_samples, double sample_rate, unsigned int start_freq, unsigned int end_freq, unsigned int rigor) {
+    multires* mr = NULL;
+    if (!(mr = calloc(1, sizeof *mr))) {
+        return NULL;
+    }
+
+    // Decimated levels are only clean up to 0.4 of their rate (see decimator.h),
+    // level i covers (0.2, 0.4] of its rate, the first one up to Nyquist
+    unsigned int last = 0;
+    while ((n_samples >> (last + 1)) >= MULTIRES_MIN_FFT && 0.2 * sample_rate / (1U << last) > start_freq) {
+        last++;
+    }
+    unsigned int first = 0;
+    while (first < last && 0.2 * sample_rate / (1U << first) >= end_freq) {
+        first++;
+    }
+
+    mr->fft_size = n_samples >> last;
+    mr->gain = (real_t) n_samples / mr->fft_size;
+    mr->n_levels = last + 1;
+    mr->first_level = first;
+    mr->levels = calloc(mr->n_levels, sizeof *mr->levels);
+    mr->fft_out = (fft_complex*) FFTW(malloc)(sizeof(fft_complex) * (mr->fft_size/2 +1));
+    mr->frequencies = malloc(sizeof(double) * (mr->fft_size/2 +1) * mr->n_levels);
+    if (!mr->levels || !mr->fft_out || !mr->frequencies) {
+        multires_deinit(mr);
+        return NULL;
+    }
+
+    // Lowest frequencies first
+    for (int l = last; l >= (int) first; --l) {
+        multires_level* level = &mr->levels[l];
+        double rate = sample_rate / (1U << l);
+        double step = rate / mr->fft_size;
+        double top = (l == 0) ? 0.5 * rate : 0.4 * rate;
+
+        level->first_bin = (l == (int) last) ? 0 : (unsigned int) (0.2 * rate / step) + 1;
+        unsigned int last_bin = (unsigned int) (top / step);
+        if (last_bin > mr->fft_size / 2) {
+            last_bin = mr->fft_size / 2;
+        }
+        level->n_bins = last_bin + 1 - level->first_bin;
+        level->offset = mr->length;
+        for (unsigned int k = level->first_bin; k <= last_bin; ++k) {
+            mr->frequencies[mr->length++] = k * step;
+        }
+    }
+
+    // Every decimator delays the levels below it (in input samples)
+    double total_delay = 0;
+    for (unsigned int l = 1; l < mr->n_levels; ++l) {
+        if (!(mr->levels[l].decimator = decimator_init(2))) {
+            multires_deinit(mr);
+            return NULL;
+        }
+        total_delay += decimator_delay(mr->levels[l].decimator) * (double) (1U << (l - 1));
+    }
+
+    // Higher levels look that much further back, so every window ends at
+    // the same instant as the last level's
+    double delay = 0;
+    for (unsigned int l = 0; l < mr->n_levels; ++l) {
+        multires_level* level = &mr->levels[l];
+        if (level->decimator) {
+            delay += decimator_delay(level->decimator) * (double) (1U << (l - 1));
+        }
+        if (l < first) {
+            continue;
+        }
+        level->size = mr->fft_size + (unsigned int) ((total_delay - delay) / (1U << l) + 0.5);
+        if (!(level->ring = (real_t*) FFTW(malloc)(2 * level->size * sizeof(real_t)))) {
+            multires_deinit(mr);
+            return NULL;
+        }
+    }
+
+    // Same plan for every level, executed on their (moving) windows
+    if (!(mr->plan = fft_plan_r2c(mr->fft_size, mr->levels[first].ring, mr->fft_out, rigor, FFTW_UNALIGNED | FFTW_PRESERVE_INPUT))) {
+        multires_deinit(mr);
+        return NULL;
+    }
+    multires_reset(mr); // Planning may overwrite the input
+    return mr;
+}
+
+void multires_deinit(multires* mr) {
+    for (unsigned int l = 0; mr->levels && l < mr->n_levels; ++l) {
+        if (mr->levels[l].decimator) {
+            decimator_deinit(mr->levels[l].decimator);
+        }
+        FFTW(free)(mr->levels[l].ring);
+    }
+    if (mr->plan) {
+        FFTW(destroy_plan)(mr->plan);
+    }
+    FFTW(free)(mr->fft_out);
+    free(mr->frequencies);
+    free(mr->scratch);
+    free(mr->levels);
+    free(mr);
+}
+
+unsigned int multires_length(multires* mr) {
+    return mr->length;
+}
+
+const double* multires_frequencies(multires* mr) {
+    return mr->frequencies;
+}
+
+static void push(multires_level* level, const real_t* samples, unsigned int length) {
+    unsigned int size = level->size;
+    for (unsigned int i = 0; i < length; ++i) {
+        level->ring[level->write_index] = level->ring[level->write_index + size] = samples[i];
+        if (++level->write_index == size) {
+            level->write_index = 0;
+        }
+    }
+}
+
+static void update_levels(multires* mr, const real_t* samples, unsigned int length) {
+    const real_t* input = samples;
+    for (unsigned int l = 0; l < mr->n_levels && length; ++l) {
+        multires_level* level = &mr->levels[l];
+        if (level->decimator) {
+            // Outputs never overtake the input, so after the first level it's in place
+            length = decimator_process(level->decimator, input, 1, length, mr->scratch);
+            input = mr->scratch;
+        }
+        if (level->ring) {
+            push(level, input, length);
+        }
+    }
+}
+
+void multires_update(multires* mr, const real_t* samples, unsigned int length) {
+    if (length > mr->scratch_size) {
+        real_t* scratch = realloc(mr->scratch, length * sizeof(real_t));
+        if (scratch) {
+            mr->scratch = scratch;
+            mr->scratch_size = length;
+        } else if (!mr->scratch_size) {
+            return; // Nothing can be decimated, every level skips these samples
+        }
+    }
+
+    // In pieces only if the scratch could not grow
+    while (length) {
+        unsigned int piece = (length < mr->scratch_size) ? length : mr->scratch_size;
+        update_levels(mr, samples, piece);
+        samples += piece;
+        length -= piece;
+    }
+}
+
+void multires_magnitude(multires* mr, real_t* out, real_t scale) {
+    scale *= mr->gain;
+    for (unsigned int l = mr->first_level; l < mr->n_levels; ++l) {
+        multires_level* level = &mr->levels[l];
+        // The oldest fft_size samples, delayed like the last level
+        FFTW(execute_dft_r2c)(mr->plan, level->ring + level->write_index, mr->fft_out);
+        fft_magnitude(mr->fft_out + level->first_bin, out + level->offset, level->n_bins, scale);
+    }
+}
+
+void multires_reset(multires* mr) {
+    for (unsigned int l = 0; l < mr->n_levels; ++l) {
+        multires_level* level = &mr->levels[l];
+        if (level->decimator) {
+            decimator_reset(level->decimator);
+        }
+        if (level->ring) {
+            memset(level->ring, 0, 2 * level->size * sizeof(real_t));
+        }
+        level->write_index = 0;
+    }
+}
@@ -0,0 +1,41 @@
+#ifndef MULTIRES_H
+#define MULTIRES_H
+
+#include "fft.h"
+
+// Octave pyramid: every level is the previous one decimated by 2 and has
+// the same (small) FFT, so each octave gets the resolution a single FFT
+// of n_samples would give to the lowest one, at a fraction of the cost.
+// Each level contributes the bins of its top octave (the whole band for
+// the last one), as one spectrum sorted by frequency, ready for output_init.
+// The windows of the higher levels are delayed by the decimators' group
+// delay, so every level shows the same instant: the whole spectrum lags
+// like the lowest octave
+
+typedef struct multires multires;
+
+// Levels go down to start_freq (with FFTs of at least 64 samples), the ones
+// entirely above end_freq are decimated but not transformed. NULL if out of memory
+multires* multires_init(
+        unsigned int n_samples,          // Equivalent resolution, sample_rate / n_samples
+        double sample_rate,
+        unsigned int start_freq,
+        unsigned int end_freq,
+        unsigned int rigor               // FFT_RIGOR_*
+        );
+
+void multires_deinit(multires* mr);
+
+// Length and frequencies of the virtual spectrum
+unsigned int multires_length(multires* mr);
+const double* multires_frequencies(multires* mr);
+
+void multires_update(multires* mr, const real_t* samples, unsigned int length);
+
+// Writes the virtual spectrum (multires_length values), like fft_magnitude,
+// scaled as if the FFT had n_samples
+void multires_magnitude(multires* mr, real_t* out, real_t scale);
+
+void multires_reset(multires* mr);
+
+#endif
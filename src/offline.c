@@ -0,0 +1,424 @@
+/*
+   This file is part of the 'term_pa_spectrum' program, which follows
+   a pulseaudio stream and displays its frequency spectrum through the
+   terminal.
+
+   Copyright (C) <2018> Jose Maria Perez Ramos
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.    See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.    If not, see <http://www.gnu.org/licenses/>.
+
+   Author: Jose Maria Perez Ramos <jose.m.perez.ramos+git gmail>
+   Date: 2018.08.13
+   Version: 1.0.0
+*/
+
+#include "offline.h"
+
+#include "fft.h"
+#include "ingest.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define OFFLINE_WINDOWS_PER_THREAD 64U // Per batch, enough to amortize the barrier
+
+struct offline_input {
+    unsigned char* map;
+    size_t map_size;
+    const unsigned char* samples;
+    size_t frames;
+    unsigned int format;                 // INGEST_*
+    unsigned int channels;
+    unsigned int sample_rate;
+};
+
+typedef struct offline_run_state offline_run_state;
+
+typedef struct {
+    offline_run_state* run;
+    pthread_t thread;
+    unsigned int index;
+    real_t* in;                          // Mono window
+    real_t* interleaved;                 // Multichannel window, before the downmix
+    fft_complex* out;
+    fft_plan plan;
+    double busy_ms;
+} offline_worker;
+
+struct offline_run_state {
+    offline_input* input;
+    unsigned int n_samples;
+    unsigned int hop_samples;
+    unsigned int n_out_values;
+    unsigned int threads;
+    real_t magnitude_scale;
+    size_t n_windows;
+    size_t batch_windows;
+    size_t n_batches;
+    real_t* batches[2];                  // Workers fill one while the other is written
+    pthread_barrier_t barrier;
+};
+
+
+static unsigned int read_le16(const unsigned char* p) {
+    return p[0] | p[1] << 8;
+}
+
+static unsigned int read_le32(const unsigned char* p) {
+    return p[0] | p[1] << 8 | p[2] << 16 | (unsigned int) p[3] << 24;
+}
+
+static double elapsed_ms(const struct timespec* start) {
+    struct timespec current;
+    clock_gettime(CLOCK_MONOTONIC, &current);
+    return (current.tv_sec - start->tv_sec) * 1000.0 + (current.tv_nsec - start->tv_nsec) / 1000000.0;
+}
+
+// Returns 1 if it's a supported WAV file, 0 if it isn't RIFF/WAVE at all
+// (i.e. raw PCM) and -1 if it's a WAV file that can't be used
+static int parse_wav(offline_input* input) {
+    const unsigned char* data = input->map;
+    size_t size = input->map_size;
+    int has_format = 0;
+
+    if (size < 12 || memcmp(data, "RIFF", 4) || memcmp(data + 8, "WAVE", 4)) {
+        return 0;
+    }
+
+    for (size_t offset = 12; offset + 8 <= size;) {
+        const unsigned char* chunk = data + offset;
+        size_t chunk_size = read_le32(chunk + 4);
+        offset += 8;
+
+        if (memcmp(chunk, "fmt ", 4) == 0 && chunk_size >= 16 && offset + chunk_size <= size) {
+            unsigned int tag = read_le16(chunk + 8);
+            unsigned int bits = read_le16(chunk + 22);
+            if (tag == 0xFFFE && chunk_size >= 40) { // WAVE_FORMAT_EXTENSIBLE, the tag starts the subformat GUID
+                tag = read_le16(chunk + 32);
+            }
+
+            if (tag == 1 && bits == 16) {
+                input->format = INGEST_S16LE;
+            } else if (tag == 3 && bits == 32) {
+                input->format = INGEST_FLOAT32LE;
+            } else {
+                fprintf(stderr, "Offline: Unsupported WAV sample format %u (%u bits), only 16 bit PCM and 32 bit float\n", tag, bits);
+                return -1;
+            }
+            input->channels = read_le16(chunk + 10);
+            input->sample_rate = read_le32(chunk + 12);
+            has_format = 1;
+        } else if (memcmp(chunk, "data", 4) == 0) {
+            if (!has_format || !input->channels || !input->sample_rate) {
+                fprintf(stderr, "Offline: WAV data before a valid format chunk\n");
+                return -1;
+            }
+            // Streamed files may not have the real size, the file is the limit
+            if (chunk_size > size - offset) {
+                chunk_size = size - offset;
+            }
+            input->samples = data + offset;
+            input->frames = chunk_size / (ingest_sample_size(input->format) * input->channels);
+            return 1;
+        }
+
+        offset += chunk_size + (chunk_size & 1); // Chunks are word aligned
+    }
+
+    fprintf(stderr, "Offline: WAV file without data\n");
+    return -1;
+}
+
+offline_input* offline_open(const char* path, unsigned int format, unsigned int channels, unsigned int sample_rate) {
+    offline_input* input = NULL;
+    struct stat st;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0 || fstat(fd, &st) < 0 || st.st_size == 0) {
+        fprintf(stderr, "Offline: Cannot read %s\n", path);
+        if (fd >= 0) {
+            close(fd);
+        }
+        return NULL;
+    }
+
+    if ((input = malloc(sizeof *input))) {
+        *input = (offline_input) {
+            .map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0),
+            .map_size = st.st_size,
+            .format = format,
+            .channels = channels,
+            .sample_rate = sample_rate,
+        };
+    }
+    close(fd);
+
+    if (!input || input->map == MAP_FAILED) {
+        fprintf(stderr, "Offline: Cannot map %s\n", path);
+        free(input);
+        return NULL;
+    }
+    madvise(input->map, input->map_size, MADV_WILLNEED);
+
+    switch (parse_wav(input)) {
+        case 0:
+            input->samples = input->map;
+            input->frames = input->map_size / (ingest_sample_size(format) * channels);
+            break;
+        case -1:
+            offline_close(input);
+            return NULL;
+    }
+
+    return input;
+}
+
+unsigned int offline_sample_rate(offline_input* input) {
+    return input->sample_rate;
+}
+
+void offline_close(offline_input* input) {
+    munmap(input->map, input->map_size);
+    free(input);
+}
+
+
+static void offline_process_window(offline_worker* worker, size_t window, real_t* magnitudes) {
+    offline_run_state* run = worker->run;
+    offline_input* input = run->input;
+    unsigned int channels = input->channels;
+    unsigned int n_samples = run->n_samples;
+    const unsigned char* src = input->samples + window * run->hop_samples * ingest_sample_size(input->format) * channels;
+    ingest_level level;
+
+    ingest_level_reset(&level);
+    if (channels == 1) {
+        ingest_samples(input->format, src, worker->in, n_samples, &level);
+    } else {
+        ingest_samples(input->format, src, worker->interleaved, n_samples * channels, &level);
+        const real_t* frame = worker->interleaved;
+        for (unsigned int i = 0; i < n_samples; ++i, frame += channels) {
+            real_t sum = 0;
+            for (unsigned int c = 0; c < channels; ++c) {
+                sum += frame[c];
+            }
+            worker->in[i] = sum / channels;
+        }
+    }
+
+    FFTW(execute_dft_r2c)(worker->plan, worker->in, worker->out);
+    fft_magnitude(worker->out, magnitudes, run->n_out_values, run->magnitude_scale);
+}
+
+// Every batch is split in contiguous slices, one per worker. Workers compute
+// batch b while the main thread writes batch b-1, the barrier swaps them
+static void* offline_worker_thread(void* userdata) {
+    offline_worker* worker = (offline_worker*) userdata;
+    offline_run_state* run = worker->run;
+
+    for (size_t batch = 0; batch <= run->n_batches; ++batch) {
+        if (batch < run->n_batches) {
+            struct timespec start;
+            clock_gettime(CLOCK_MONOTONIC, &start);
+
+            size_t first = batch * run->batch_windows;
+            size_t count = run->n_windows - first;
+            if (count > run->batch_windows) {
+                count = run->batch_windows;
+            }
+            size_t slice = (count + run->threads - 1) / run->threads;
+            size_t begin = worker->index * slice;
+            size_t end = (begin + slice < count) ? begin + slice : count;
+
+            real_t* magnitudes = run->batches[batch & 1];
+            for (size_t i = begin; i < end; ++i) {
+                offline_process_window(worker, first + i, magnitudes + i * run->n_out_values);
+            }
+            worker->busy_ms += elapsed_ms(&start);
+        }
+        pthread_barrier_wait(&run->barrier);
+    }
+
+    return NULL;
+}
+
+static void offline_write_batch(offline_run_state* run, size_t batch, output_context* out_ctx, char* text, FILE* out) {
+    size_t first = batch * run->batch_windows;
+    size_t count = run->n_windows - first;
+    if (count > run->batch_windows) {
+        count = run->batch_windows;
+    }
+    real_t* magnitudes = run->batches[batch & 1];
+
+    if (!out_ctx) {
+        fwrite(magnitudes, sizeof(real_t) * run->n_out_values, count, out);
+        return;
+    }
+    // Smoothing depends on the previous line, so this is serial
+    size_t length = 0;
+    for (size_t i = 0; i < count; ++i) {
+        length += output_print(out_ctx, magnitudes + i * run->n_out_values, text + length);
+        text[length++] = '\n';
+    }
+    fwrite(text, 1, length, out);
+}
+
+typedef struct {
+    size_t n_windows;
+    double wall_ms;
+    double busy_ms;                      // Added up over the workers
+} offline_pass_stats;
+
+// Without out, the spectrogram is computed but not written (only measured)
+static int offline_pass(
+        offline_input* input,
+        unsigned int n_samples,
+        unsigned int hop_samples,
+        unsigned int threads,
+        unsigned int rigor,
+        output_context* out_ctx,
+        FILE* out,
+        offline_pass_stats* stats
+        ) {
+
+    offline_run_state run = {
+        .input = input,
+        .n_samples = n_samples,
+        .hop_samples = hop_samples ? hop_samples : n_samples,
+        .n_out_values = n_samples/2 +1,
+        .threads = threads,
+        .magnitude_scale = (input->format == INGEST_FLOAT32LE) ? 32768 : 1,
+        .batch_windows = (size_t) threads * OFFLINE_WINDOWS_PER_THREAD,
+    };
+    run.n_windows = (input->frames >= n_samples) ? (input->frames - n_samples) / run.hop_samples + 1 : 0;
+    run.n_batches = (run.n_windows + run.batch_windows - 1) / run.batch_windows;
+    run.batches[0] = malloc(sizeof(real_t) * run.n_out_values * run.batch_windows);
+    run.batches[1] = malloc(sizeof(real_t) * run.n_out_values * run.batch_windows);
+
+    // The planner is not thread safe, plans are created here, executed there
+    offline_worker* workers = calloc(threads, sizeof *workers);
+    for (unsigned int i = 0; i < threads; ++i) {
+        offline_worker* worker = &workers[i];
+        worker->run = &run;
+        worker->index = i;
+        worker->in = (real_t*) FFTW(malloc)(sizeof(real_t) * n_samples);
+        worker->interleaved = (input->channels > 1) ? (real_t*) malloc(sizeof(real_t) * n_samples * input->channels) : NULL;
+        worker->out = (fft_complex*) FFTW(malloc)(sizeof(fft_complex) * run.n_out_values);
+        worker->plan = fft_plan_r2c(n_samples, worker->in, worker->out, rigor, 0);
+    }
+
+    // Lines of a whole batch are written at once
+    char* text = (out && out_ctx) ? malloc((output_line_max_length(out_ctx) + 1) * run.batch_windows) : NULL;
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    pthread_barrier_init(&run.barrier, NULL, threads + 1);
+    for (unsigned int i = 0; i < threads; ++i) {
+        pthread_create(&workers[i].thread, NULL, offline_worker_thread, &workers[i]);
+    }
+    for (size_t batch = 0; batch <= run.n_batches; ++batch) {
+        if (batch && out) {
+            offline_write_batch(&run, batch - 1, out_ctx, text, out);
+        }
+        pthread_barrier_wait(&run.barrier);
+    }
+
+    double busy_ms = 0;
+    for (unsigned int i = 0; i < threads; ++i) {
+        pthread_join(workers[i].thread, NULL);
+        busy_ms += workers[i].busy_ms;
+    }
+    if (out) {
+        fflush(out);
+    }
+    *stats = (offline_pass_stats) {
+        .n_windows = run.n_windows,
+        .wall_ms = elapsed_ms(&start),
+        .busy_ms = busy_ms,
+    };
+    pthread_barrier_destroy(&run.barrier);
+
+    int ret = (out && ferror(out)) ? 1 : 0;
+    free(text);
+    for (unsigned int i = 0; i < threads; ++i) {
+        FFTW(destroy_plan)(workers[i].plan);
+        FFTW(free)(workers[i].out);
+        free(workers[i].interleaved);
+        FFTW(free)(workers[i].in);
+    }
+    free(workers);
+    free(run.batches[1]);
+    free(run.batches[0]);
+
+    return ret;
+}
+
+static unsigned int offline_threads(unsigned int threads) {
+    if (!threads) {
+        long online = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = (online > 0) ? online : 1;
+    }
+    return threads;
+}
+
+int offline_run(
+        offline_input* input,
+        unsigned int n_samples,
+        unsigned int hop_samples,
+        unsigned int threads,
+        unsigned int rigor,
+        output_context* out_ctx,
+        FILE* out
+        ) {
+
+    threads = offline_threads(threads);
+    offline_pass_stats stats;
+    int ret = offline_pass(input, n_samples, hop_samples, threads, rigor, out_ctx, out, &stats);
+
+    // busy/wall is how many cores were used, per thread it's the parallel efficiency
+    fprintf(stderr, "Offline: %zu frames in %.3f s, %.0f frames/s with %u threads (%.0f frames/s per busy thread, %.0f%% efficiency)\n",
+            stats.n_windows, stats.wall_ms / 1000, stats.n_windows * 1000 / stats.wall_ms, threads,
+            stats.busy_ms > 0 ? stats.n_windows * 1000 / stats.busy_ms : 0, 100 * stats.busy_ms / (threads * stats.wall_ms));
+
+    return ret;
+}
+
+void offline_scaling(
+        offline_input* input,
+        unsigned int n_samples,
+        unsigned int hop_samples,
+        unsigned int max_threads,
+        unsigned int rigor
+        ) {
+
+    max_threads = offline_threads(max_threads);
+    double single_fps = 0;
+    for (unsigned int threads = 1; threads <= max_threads; threads = (threads < max_threads && 2 * threads > max_threads) ? max_threads : 2 * threads) {
+        offline_pass_stats stats;
+        offline_pass(input, n_samples, hop_samples, threads, rigor, NULL, NULL, &stats);
+        double fps = stats.n_windows * 1000 / stats.wall_ms;
+        if (threads == 1) {
+            single_fps = fps;
+        }
+        fprintf(stderr, "Offline: %3u threads, %.0f frames/s, %.2fx the single thread (%.0f%% efficiency)\n",
+                threads, fps, fps / single_fps, 100 * fps / (single_fps * threads));
+    }
+}
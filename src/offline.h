@@ -0,0 +1,47 @@
+#ifndef OFFLINE_H
+#define OFFLINE_H
+
+#include "output.h"
+
+#include <stdio.h>
+
+// Offline analysis of a recorded file (WAV, or raw PCM as described by the
+// options), memory mapped and split across worker threads. Multichannel
+// input is downmixed to mono
+
+typedef struct offline_input offline_input;
+
+// format/channels/sample_rate are only used for raw PCM, WAV files carry
+// their own. Returns NULL (and prints why) if the file can't be used
+offline_input* offline_open(const char* path, unsigned int format, unsigned int channels, unsigned int sample_rate);
+
+unsigned int offline_sample_rate(offline_input* input);
+
+void offline_close(offline_input* input);
+
+// Writes the spectrogram of every window to out: output_print lines using
+// out_ctx, or raw magnitude frames (n_samples/2+1 native real_t values per
+// window) if out_ctx is NULL. Throughput is reported on stderr.
+// 0 threads means one per online CPU. Returns 0 on success
+int offline_run(
+        offline_input* input,
+        unsigned int n_samples,
+        unsigned int hop_samples,        // 0 is n_samples
+        unsigned int threads,
+        unsigned int rigor,              // FFT_RIGOR_*
+        output_context* out_ctx,
+        FILE* out
+        );
+
+// Only measures: computes the spectrogram (without writing it) with 1, 2,
+// 4... up to max_threads workers, and reports on stderr the frames/s of
+// each and its speedup over a single worker
+void offline_scaling(
+        offline_input* input,
+        unsigned int n_samples,
+        unsigned int hop_samples,        // 0 is n_samples
+        unsigned int max_threads,        // 0 is one per online CPU
+        unsigned int rigor               // FFT_RIGOR_*
+        );
+
+#endif
@@ -25,11 +25,21 @@
 
 // This file groups, smooths and maps to the output chars, nothing else
 #include "output.h"
+#include "output_internal.h"
 
-#include <locale.h>
-#include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <tgmath.h> // log/exp in the precision of real_t
+#include <wchar.h>
+
+#ifndef DOUBLE_PRECISION
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+#endif
 
 #define max(a,b) \
     ({ __typeof__ (a) _a = (a); \
@@ -59,46 +69,209 @@ L"\u2847\u28C7\u28E7\u28F7\u28FF" // "⡇⣇⣧⣷⣿"
 unsigned int braille_points_per_char = 2;
 unsigned int braille_levels = 5;
 
-wchar_t* silence_str = L" No data ";
+char* silence_str = " No data ";
+
+// Glyphs are encoded to UTF-8 once, when the charset is set, so rendering
+// is just copying bytes (no locale-dependent conversion per frame)
+#define OUTPUT_MAX_GLYPHS 25U
+#define OUTPUT_MAX_LEVELS 9U // Per point, bars
+typedef struct {
+    char bytes[4];                                       // Always copied whole, only length bytes are kept
+    unsigned int length;
+} output_glyph;
+
+// Every stage runs a kernel specialized for the current configuration,
+// picked by output_select_kernels whenever a setter changes it
+typedef void (*output_transform_kernel)(output_context* out_ctx, real_t* values);
+typedef void (*output_accumulate_kernel)(output_context* out_ctx, real_t* values);
+typedef void (*output_smooth_kernel)(output_context* out_ctx, real_t** output_buffer_p, real_t* min_p, real_t* max_p);
+typedef size_t (*output_glyph_kernel)(output_context* out_ctx, const unsigned char* levels, char* buffer);
 
 struct output_context {
+    double* data_frequency;                              // Hz, a copy, the mapping is rebuilt from it
+    unsigned int data_length;
     unsigned int* data_buffer_index_to_acc_buffer_index; // Data buffer index -> Acc buffer index relationship
     unsigned int* acc_buffer_data_count;                 // Acc buffer data values count by position
-    double* acc_buffer_avg_factor;
+    real_t* acc_buffer_avg_factor;
+    unsigned int* spare_data_buffer_index_to_acc_buffer_index; // The next mapping is built here, then swapped
+    unsigned int* spare_acc_buffer_data_count;
+    real_t* spare_acc_buffer_avg_factor;
+    unsigned int points_capacity;                        // Allocated length of the per point buffers
     unsigned int min_data_index;                         // Min relevant data buffer index
     unsigned int max_data_index;                         // Max relevant data buffer index
     unsigned int num_points;                             // Number of points to be displayed (length of acc buffer and related buffers)
-    double abs_min;                                      // Values lower than this are mapped to the min value
-    double abs_max;                                      // Values higher than this are mapped to the max value
+    unsigned int no_grouping;                            // Data index - min_data_index is the acc index
+    unsigned int all_points_fed;                         // No acc buffer position is left without data
+    real_t abs_min;                                      // Values lower than this are mapped to the min value
+    real_t abs_max;                                      // Values higher than this are mapped to the max value
     int group_func;                                      // MAX/AVG
     int smoothing;                                       // Smoothing strategy
-    double smoothing_new_value_factor;                   // Smoothing factor for new values
-    double smoothing_old_value_factor;                   // Smoothing factor for old values
-    double smoothing_new_limit_factor;                   // Smoothing factor for new limit
-    double smoothing_old_limit_factor;                   // Smoothing factor for old limit
-    double smoothing_min_limit;
-    double smoothing_max_limit;
+    real_t smoothing_new_value_factor;                   // Smoothing factor for new values
+    real_t smoothing_old_value_factor;                   // Smoothing factor for old values
+    real_t smoothing_new_limit_factor;                   // Smoothing factor for new limit
+    real_t smoothing_old_limit_factor;                   // Smoothing factor for old limit
+    real_t smoothing_min_limit;
+    real_t smoothing_max_limit;
     unsigned int transform_flags;                        // Transform function
+    unsigned int log_input;                              // The log transform was done by the caller
 
-    double sigmoid_scaling_factor;                       // Apply sigmoid to the output
-    double lineal_scaling_factor;                        // Scale results to see better the peaks
+    real_t sigmoid_scaling_factor;                       // Apply sigmoid to the output
+    real_t lineal_scaling_factor;                        // Scale results to see better the peaks
+    real_t level_thresholds[OUTPUT_MAX_LEVELS - 1];      // Normalized value where each level > 0 starts (INFINITY if never)
 
     unsigned int visualization_levels;
     unsigned int visualization_points_per_char;
-    wchar_t* visualization_str;
+    output_glyph visualization_glyphs[OUTPUT_MAX_GLYPHS];
+    unsigned int mirrored;                               // Highest frequencies first
+
+    real_t* acc_buffer;                                  // Intermediate acc buffers
+    real_t* smooth_buffer;
+    real_t* output_buffer;                               // Last updated values (acc or smooth buffer)
+    real_t output_min;                                   // Last updated limits
+    real_t output_max;
+
+    unsigned char* level_buffer;                         // Quantized points in data order, +1 to pad the last char
 
-    double* acc_buffer;                                  // Intermediate acc buffers
-    double* smooth_buffer;
-    wchar_t* wchar_buffer;
+    output_transform_kernel transform_kernel;
+    output_accumulate_kernel accumulate_kernel;
+    output_smooth_kernel smooth_kernel;
+    output_glyph_kernel glyph_kernel;
 
-    wchar_t* provided_silence_str;
-    wchar_t* wchar_silence_buffer;
+    const char* provided_silence_str;
+    char* silence_buffer;                                // UTF-8, padded to the line width
+    size_t silence_length;
 };
 
 
+// Grows *buffer to size bytes, it's kept as is if it cannot be done
+static int output_grow(void* buffer, size_t size) {
+    void* grown = realloc(*(void**) buffer, size);
+    if (!grown) {
+        return -1;
+    }
+    *(void**) buffer = grown;
+    return 0;
+}
+
+// Per point buffers, only reallocated to grow. On failure every buffer
+// still has room for the previous capacity, -1 is returned
+static int output_reserve_points(output_context* out_ctx, unsigned int num_points) {
+    if (num_points <= out_ctx->points_capacity) {
+        return 0;
+    }
+    int failed = output_grow(&out_ctx->acc_buffer_data_count, num_points * sizeof *(out_ctx->acc_buffer_data_count))
+        || output_grow(&out_ctx->spare_acc_buffer_data_count, num_points * sizeof *(out_ctx->spare_acc_buffer_data_count))
+        || output_grow(&out_ctx->acc_buffer_avg_factor, num_points * sizeof *(out_ctx->acc_buffer_avg_factor))
+        || output_grow(&out_ctx->spare_acc_buffer_avg_factor, num_points * sizeof *(out_ctx->spare_acc_buffer_avg_factor))
+        || output_grow(&out_ctx->acc_buffer, num_points * sizeof *(out_ctx->acc_buffer))
+        || output_grow(&out_ctx->smooth_buffer, num_points * sizeof *(out_ctx->smooth_buffer))
+        || output_grow(&out_ctx->silence_buffer, num_points * 4)
+        || output_grow(&out_ctx->level_buffer, num_points + 1);
+    out_ctx->output_buffer = out_ctx->smooth_buffer; // The old one may be gone
+    if (failed) {
+        return -1;
+    }
+    memset(out_ctx->smooth_buffer + out_ctx->points_capacity, 0, (num_points - out_ctx->points_capacity) * sizeof *(out_ctx->smooth_buffer));
+    out_ctx->points_capacity = num_points;
+    return 0;
+}
+
+// Builds the data index -> point tables in the spare ones and swaps them in,
+// O(data_length). Returns -1, and the mapping is kept, if the per point
+// buffers cannot grow
+static int output_build_mapping(
+        output_context* out_ctx,
+        unsigned int min_freq,
+        unsigned int max_freq,
+        unsigned int num_points,
+        int group,
+        int group_func
+        ) {
+    unsigned int data_length = out_ctx->data_length;
+    const double* data_frequency = out_ctx->data_frequency;
+    unsigned int i;
+    int no_grouping = 0;
+    int log_frequencies = 0;
+
+    switch ((group_func && group) ? group : OUTPUT_NO_GROUPING) {
+        case OUTPUT_LOGARITMIC_GROUPING:
+            min_freq = log(min_freq);
+            max_freq = log(max_freq);
+            log_frequencies = 1;
+            break;
+        case OUTPUT_LINEAL_GROUPING:
+            break;
+        case OUTPUT_NO_GROUPING:
+        default:
+            no_grouping = 1;
+            num_points = data_length;
+    }
+    if (output_reserve_points(out_ctx, num_points)) {
+        return -1;
+    }
+
+    unsigned int* acc_index = out_ctx->spare_data_buffer_index_to_acc_buffer_index;
+    unsigned int* data_count = out_ctx->spare_acc_buffer_data_count;
+    real_t* avg_factor = out_ctx->spare_acc_buffer_avg_factor;
+    unsigned int min_data_index = data_length;
+    unsigned int max_data_index = 0;
+    memset(data_count, 0, num_points * sizeof *data_count);
+
+    unsigned int target_acc_index = -1;
+    for (i = 0; i < data_length; ++i) {
+        double freq = log_frequencies ? log(data_frequency[i]) : data_frequency[i]; // Frequencies are sorted
+        if (freq < min_freq || freq > max_freq) {
+            continue;
+        }
+
+        min_data_index = min(min_data_index, i);
+        max_data_index = max(max_data_index, i);
+
+        if (no_grouping) {
+            target_acc_index++;
+        } else {
+            target_acc_index = ((freq - min_freq) / (max_freq - min_freq)) * num_points;
+            target_acc_index = min(target_acc_index, num_points-1); // It's possible that target_acc_index == num_points if freq == max_freq
+        }
+
+        acc_index[i] = target_acc_index;
+        data_count[target_acc_index]++;
+    }
+
+    for (i = 0; i < num_points; ++i) {
+        if (data_count[i] > 0) {
+            avg_factor[i] = 1.0 / data_count[i];
+        } else {
+            avg_factor[i] = 0;
+        }
+    }
+
+    num_points = target_acc_index + 1; // Overwrite with max available freq index
+    unsigned int all_points_fed = 1;
+    for (i = 0; i < num_points; ++i) {
+        all_points_fed &= data_count[i] > 0;
+    }
+
+    // Swap
+    out_ctx->spare_data_buffer_index_to_acc_buffer_index = out_ctx->data_buffer_index_to_acc_buffer_index;
+    out_ctx->spare_acc_buffer_data_count = out_ctx->acc_buffer_data_count;
+    out_ctx->spare_acc_buffer_avg_factor = out_ctx->acc_buffer_avg_factor;
+    out_ctx->data_buffer_index_to_acc_buffer_index = acc_index;
+    out_ctx->acc_buffer_data_count = data_count;
+    out_ctx->acc_buffer_avg_factor = avg_factor;
+
+    out_ctx->min_data_index = min_data_index;
+    out_ctx->max_data_index = max_data_index;
+    out_ctx->num_points = num_points;
+    out_ctx->no_grouping = no_grouping;
+    out_ctx->all_points_fed = all_points_fed;
+    out_ctx->group_func = group_func;
+    return 0;
+}
+
 output_context* output_init(
         unsigned int data_length,
-        double* data_frequency,
+        const double* data_frequency,
         unsigned int min_freq,
         unsigned int max_freq,
         unsigned int num_points,
@@ -109,86 +282,42 @@ output_context* output_init(
         unsigned int transform_flags
         ) {
 
-    setlocale(LC_ALL, "");
-
     output_context* out_ctx = NULL;
     if ((out_ctx = malloc(sizeof *out_ctx))) {
-        unsigned int i;
-        int no_grouping = 0;
-
-        switch ((group_func && group) ? group : OUTPUT_NO_GROUPING) {
-            case OUTPUT_LOGARITMIC_GROUPING:
-                min_freq = log(min_freq);
-                max_freq = log(max_freq);
-                for (i = 0; i < data_length; ++i) {
-                    data_frequency[i] = log(data_frequency[i]);
-                }
-                break;
-            case OUTPUT_LINEAL_GROUPING:
-                break;
-            case OUTPUT_NO_GROUPING:
-            default:
-                no_grouping = 1;
-                num_points = data_length;
-        }
-
         if (transform_flags & OUTPUT_LOGARITMIC_TRANSFORM) {
             abs_max = log(abs_max);
             abs_min = log(abs_min);
         }
 
         *out_ctx = (output_context) {
-            .data_buffer_index_to_acc_buffer_index = (unsigned int*) malloc(data_length * sizeof *(out_ctx->data_buffer_index_to_acc_buffer_index)),
-                .acc_buffer_data_count = calloc(num_points, sizeof *(out_ctx->acc_buffer_data_count)),
-                .acc_buffer_avg_factor = calloc(num_points, sizeof *(out_ctx->acc_buffer_avg_factor)),
+            .data_frequency = malloc(data_length * sizeof *(out_ctx->data_frequency)),
+                .data_length = data_length,
+                .data_buffer_index_to_acc_buffer_index = (unsigned int*) malloc(data_length * sizeof *(out_ctx->data_buffer_index_to_acc_buffer_index)),
+                .spare_data_buffer_index_to_acc_buffer_index = (unsigned int*) malloc(data_length * sizeof *(out_ctx->spare_data_buffer_index_to_acc_buffer_index)),
                 .min_data_index = data_length,
                 .max_data_index = 0,
                 .abs_min = abs_min,
                 .abs_max = abs_max,
-                .group_func = group_func,
                 .transform_flags = transform_flags,
-
-                .acc_buffer = malloc(num_points * sizeof *(out_ctx->acc_buffer)),
-                .smooth_buffer = calloc(num_points, sizeof *(out_ctx->smooth_buffer)),
-                .wchar_buffer = malloc((num_points +1) * sizeof *(out_ctx->wchar_buffer)),
-                .wchar_silence_buffer = malloc((num_points +1) * sizeof *(out_ctx->wchar_buffer)),
         };
-
-
-        unsigned int target_acc_index = -1;
-        for (i = 0; i < data_length; ++i) {
-            double freq = data_frequency[i]; // Frequencies are sorted
-            if (freq < min_freq || freq > max_freq) {
-                continue;
-            }
-
-            out_ctx->min_data_index = min(out_ctx->min_data_index, i);
-            out_ctx->max_data_index = max(out_ctx->max_data_index, i);
-
-            if (no_grouping) {
-                target_acc_index++;
-            } else {
-                target_acc_index = ((freq - min_freq) / (max_freq - min_freq)) * num_points;
-                target_acc_index = min(target_acc_index, num_points-1); // It's possible that target_acc_index == num_points if freq == max_freq
-            }
-
-            out_ctx->data_buffer_index_to_acc_buffer_index[i] = target_acc_index;
-            out_ctx->acc_buffer_data_count[target_acc_index]++;
+        // Regrouping into up to a point per data value never allocates
+        if (!out_ctx->data_frequency
+                || !out_ctx->data_buffer_index_to_acc_buffer_index
+                || !out_ctx->spare_data_buffer_index_to_acc_buffer_index
+                || output_reserve_points(out_ctx, max(num_points, data_length))) {
+            output_deinit(out_ctx);
+            return NULL;
         }
+        memcpy(out_ctx->data_frequency, data_frequency, data_length * sizeof *data_frequency);
+        output_build_mapping(out_ctx, min_freq, max_freq, num_points, group, group_func);
 
-        for (i = 0; i < num_points; ++i) {
-            if (out_ctx->acc_buffer_data_count[i] > 0) {
-                out_ctx->acc_buffer_avg_factor[i] = 1.0 / out_ctx->acc_buffer_data_count[i];
-            } else {
-                out_ctx->acc_buffer_avg_factor[i] = 0;
-            }
-        }
-
-        num_points = target_acc_index + 1; // Overwrite with max available freq index
-        out_ctx->num_points = num_points;
+        out_ctx->output_buffer = out_ctx->smooth_buffer; // Zeroed, until the first update
+        out_ctx->output_min = abs_min;
+        out_ctx->output_max = abs_max;
 
         output_set_charset(out_ctx, OUTPUT_CHARSET_BARS);
         output_set_silence_str(out_ctx, NULL);
+        output_set_mirrored(out_ctx, 0);
         output_set_smoothing(out_ctx, OUTPUT_NO_SMOOTH);
         output_set_smoothing_factors(out_ctx, .5, .5);
         output_set_lineal_scale_factor_offset(out_ctx, 0);
@@ -197,30 +326,95 @@ output_context* output_init(
     return out_ctx;
 }
 
+static void output_select_kernels(output_context* out_ctx);
+
+// Level k is reached when f(x) * lineal_scaling_factor * levels >= k, f being
+// the sigmoid or the identity. Solved for the normalized value x once,
+// so rendering only compares
+static void output_update_thresholds(output_context* out_ctx) {
+    double sigmoid = out_ctx->sigmoid_scaling_factor;
+    double scale = out_ctx->lineal_scaling_factor * out_ctx->visualization_levels;
+
+    for (unsigned int k = 1; k < OUTPUT_MAX_LEVELS; ++k) {
+        double threshold = INFINITY;
+        if (k < out_ctx->visualization_levels && scale > 0) {
+            double target = k / scale;
+            if (sigmoid <= 0) {
+                threshold = target;
+            } else if (target < 1) {
+                threshold = .5 - log(1 / target - 1) / sigmoid;
+            }
+        }
+        out_ctx->level_thresholds[k - 1] = threshold;
+    }
+}
+
 void output_set_lineal_scale_factor_offset(output_context* out_ctx, double offset) {
     out_ctx->lineal_scaling_factor = 1.0 + offset;
+    output_update_thresholds(out_ctx);
 }
 
 void output_set_sigmoid_scale_factor(output_context* out_ctx, double factor) {
     out_ctx->sigmoid_scaling_factor = factor;
+    output_update_thresholds(out_ctx);
 }
 
-void output_update_silence_buffer(output_context* out_ctx) {
-    unsigned int num_chars = out_ctx->num_points / out_ctx->visualization_points_per_char + (out_ctx->num_points % out_ctx->visualization_points_per_char ? 1 : 0);
+// Encodes a code point, returns its length
+static unsigned int utf8_encode(wchar_t wc, char* out) {
+    unsigned int c = wc;
+    if (c < 0x80) {
+        out[0] = c;
+        return 1;
+    } else if (c < 0x800) {
+        out[0] = 0xC0 | (c >> 6);
+        out[1] = 0x80 | (c & 0x3F);
+        return 2;
+    } else if (c < 0x10000) {
+        out[0] = 0xE0 | (c >> 12);
+        out[1] = 0x80 | ((c >> 6) & 0x3F);
+        out[2] = 0x80 | (c & 0x3F);
+        return 3;
+    }
+    out[0] = 0xF0 | (c >> 18);
+    out[1] = 0x80 | ((c >> 12) & 0x3F);
+    out[2] = 0x80 | ((c >> 6) & 0x3F);
+    out[3] = 0x80 | (c & 0x3F);
+    return 4;
+}
+
+static unsigned int output_num_chars(output_context* out_ctx) {
+    return out_ctx->num_points / out_ctx->visualization_points_per_char + (out_ctx->num_points % out_ctx->visualization_points_per_char ? 1 : 0);
+}
+
+unsigned int output_points_per_char(output_context* out_ctx) {
+    return out_ctx->visualization_points_per_char;
+}
 
-    out_ctx->wchar_silence_buffer[num_chars] = '\0';
-    wchar_t* silence_str_source = (out_ctx->provided_silence_str) ? out_ctx->provided_silence_str : silence_str;
-    wcsncpy(out_ctx->wchar_silence_buffer, silence_str_source, num_chars);
-    for (unsigned int i = wcslen(silence_str_source); i < num_chars; ++i) {
-        out_ctx->wchar_silence_buffer[i] = L' ';
+void output_update_silence_buffer(output_context* out_ctx) {
+    unsigned int num_chars = output_num_chars(out_ctx);
+    const char* source = (out_ctx->provided_silence_str) ? out_ctx->provided_silence_str : silence_str;
+
+    // Copy up to num_chars code points (UTF-8 continuation bytes don't count), then pad
+    size_t length = 0;
+    unsigned int chars = 0;
+    for (; source[length]; ++length) {
+        if ((source[length] & 0xC0) != 0x80 && chars++ == num_chars) {
+            break;
+        }
     }
+    memcpy(out_ctx->silence_buffer, source, length);
+    for (; chars < num_chars; ++chars) {
+        out_ctx->silence_buffer[length++] = ' ';
+    }
+    out_ctx->silence_length = length;
 }
 
 void output_set_charset(output_context* out_ctx, int charset) {
+    wchar_t* visualization_str;
     switch (charset) {
         case OUTPUT_CHARSET_BRAILLE:
         case OUTPUT_CHARSET_BRAILLE_WIDE:
-            out_ctx->visualization_str = braille_str;
+            visualization_str = braille_str;
             out_ctx->visualization_levels = braille_levels;
             out_ctx->visualization_points_per_char = braille_points_per_char;
 
@@ -231,14 +425,46 @@ void output_set_charset(output_context* out_ctx, int charset) {
             break;
         case OUTPUT_CHARSET_BARS:
         default:
-            out_ctx->visualization_str = bars_str;
+            visualization_str = bars_str;
             out_ctx->visualization_levels = bars_levels;
             out_ctx->visualization_points_per_char = bars_points_per_char;
     }
+
+    for (unsigned int i = 0; visualization_str[i] && i < OUTPUT_MAX_GLYPHS; ++i) {
+        output_glyph* glyph = &out_ctx->visualization_glyphs[i];
+        memset(glyph->bytes, 0, sizeof glyph->bytes);
+        glyph->length = utf8_encode(visualization_str[i], glyph->bytes);
+    }
     output_update_silence_buffer(out_ctx);
+    output_update_thresholds(out_ctx);
+    output_select_kernels(out_ctx);
+}
+
+void output_set_mirrored(output_context* out_ctx, int mirrored) {
+    out_ctx->mirrored = mirrored;
+    output_select_kernels(out_ctx);
+}
+
+void output_set_log_input(output_context* out_ctx, int log_input) {
+    out_ctx->log_input = log_input;
+    output_select_kernels(out_ctx);
 }
 
-void output_set_silence_str(output_context* out_ctx, wchar_t* provided_silence_str) {
+int output_set_grouping(output_context* out_ctx, unsigned int min_freq, unsigned int max_freq, unsigned int num_points, int group, int group_func) {
+    if (output_build_mapping(out_ctx, min_freq, max_freq, num_points, group, group_func)) {
+        return -1;
+    }
+    // Points may mean other frequencies now, smoothing starts over
+    memset(out_ctx->smooth_buffer, 0, out_ctx->points_capacity * sizeof *(out_ctx->smooth_buffer));
+    out_ctx->output_buffer = out_ctx->smooth_buffer;
+    out_ctx->smoothing_max_limit = 0;
+    out_ctx->smoothing_min_limit = 0;
+    output_update_silence_buffer(out_ctx);
+    output_select_kernels(out_ctx);
+    return 0;
+}
+
+void output_set_silence_str(output_context* out_ctx, const char* provided_silence_str) {
     out_ctx->provided_silence_str = provided_silence_str;
     output_update_silence_buffer(out_ctx);
 }
@@ -247,6 +473,7 @@ void output_set_smoothing(output_context* out_ctx, int smoothing) {
     out_ctx->smoothing = smoothing;
     out_ctx->smoothing_max_limit = 0;
     out_ctx->smoothing_min_limit = 0;
+    output_select_kernels(out_ctx);
 }
 void output_set_smoothing_factors(output_context* out_ctx, double new_value_factor, double new_limit_factor) {
     new_value_factor = max(min(new_value_factor, 1.0), 0.0);
@@ -259,142 +486,301 @@ void output_set_smoothing_factors(output_context* out_ctx, double new_value_fact
 
 
 void output_deinit(output_context* out_ctx) {
+    free(out_ctx->data_frequency);
     free(out_ctx->data_buffer_index_to_acc_buffer_index);
     free(out_ctx->acc_buffer_data_count);
     free(out_ctx->acc_buffer_avg_factor);
+    free(out_ctx->spare_data_buffer_index_to_acc_buffer_index);
+    free(out_ctx->spare_acc_buffer_data_count);
+    free(out_ctx->spare_acc_buffer_avg_factor);
     free(out_ctx->acc_buffer);
     free(out_ctx->smooth_buffer);
-    free(out_ctx->wchar_buffer);
-    free(out_ctx->wchar_silence_buffer);
+    free(out_ctx->silence_buffer);
+    free(out_ctx->level_buffer);
     free(out_ctx);
 }
 
-wchar_t* output_print_silence(output_context* out_ctx) {
-    return out_ctx->wchar_silence_buffer;
+size_t output_line_max_length(output_context* out_ctx) {
+    unsigned int num_chars = output_num_chars(out_ctx);
+    size_t glyphs_length = num_chars * 3 + 1; // BMP glyphs, +1 as glyphs are copied 4 bytes at a time
+    return max(glyphs_length, out_ctx->silence_length);
+}
+
+void output_data_range(output_context* out_ctx, unsigned int* min_data_index, unsigned int* max_data_index) {
+    *min_data_index = out_ctx->min_data_index;
+    *max_data_index = out_ctx->max_data_index;
+}
+
+size_t output_print_silence(output_context* out_ctx, char* buffer) {
+    memcpy(buffer, out_ctx->silence_buffer, out_ctx->silence_length);
+    return out_ctx->silence_length;
+}
+
+///// Transform
+
+static void transform_none(output_context* out_ctx, real_t* values) {
+    (void) out_ctx;
+    (void) values;
+}
+
+static void transform_log(output_context* out_ctx, real_t* values) {
+    for (unsigned int i = out_ctx->min_data_index; i <= out_ctx->max_data_index; ++i) {
+        values[i] = log(values[i]);
+    }
+}
+
+///// Accumulate
+
+// Ungrouped points are the displayed range of the data as is
+static void accumulate_copy(output_context* out_ctx, real_t* values) {
+    memcpy(out_ctx->acc_buffer, values + out_ctx->min_data_index, out_ctx->num_points * sizeof *values);
+}
+
+static void accumulate_max(output_context* out_ctx, real_t* values) {
+    real_t* acc_buffer = out_ctx->acc_buffer;
+    const unsigned int* acc_index = out_ctx->data_buffer_index_to_acc_buffer_index;
+
+    memset(acc_buffer, 0, out_ctx->num_points * sizeof *acc_buffer);
+    for (unsigned int i = out_ctx->min_data_index; i <= out_ctx->max_data_index; ++i) {
+        acc_buffer[acc_index[i]] = max(acc_buffer[acc_index[i]], values[i]);
+    }
+}
+
+static void accumulate_avg(output_context* out_ctx, real_t* values) {
+    real_t* acc_buffer = out_ctx->acc_buffer;
+    const real_t* avg_factor = out_ctx->acc_buffer_avg_factor;
+    const unsigned int* acc_index = out_ctx->data_buffer_index_to_acc_buffer_index;
+    unsigned int num_points = out_ctx->num_points;
+
+    memset(acc_buffer, 0, num_points * sizeof *acc_buffer);
+    for (unsigned int i = out_ctx->min_data_index; i <= out_ctx->max_data_index; ++i) {
+        acc_buffer[acc_index[i]] += values[i];
+    }
+    for (unsigned int i = 0; i < num_points; ++i) {
+        acc_buffer[i] *= avg_factor[i];
+    }
+}
+
+///// Smooth
+
+static void smooth_none(output_context* out_ctx, real_t** output_buffer_p, real_t* min_p, real_t* max_p) {
+    *min_p = out_ctx->abs_min;
+    *max_p = out_ctx->abs_max;
+    *output_buffer_p = out_ctx->acc_buffer;
+}
+
+static void smooth_limits(output_context* out_ctx, real_t local_min, real_t local_max, real_t** output_buffer_p, real_t* min_p, real_t* max_p) {
+    *min_p = out_ctx->smoothing_min_limit * out_ctx->smoothing_old_limit_factor + local_min * out_ctx->smoothing_new_limit_factor;
+    *max_p = out_ctx->smoothing_max_limit * out_ctx->smoothing_old_limit_factor + local_max * out_ctx->smoothing_new_limit_factor;
+    *output_buffer_p = out_ctx->smooth_buffer;
+
+    out_ctx->smoothing_min_limit = *min_p;
+    out_ctx->smoothing_max_limit = *max_p;
 }
 
-void transform(output_context* out_ctx, double* values) {
-    if (out_ctx->transform_flags & OUTPUT_LOGARITMIC_TRANSFORM) {
-        for (unsigned int i = out_ctx->min_data_index; i <= out_ctx->max_data_index; ++i) {
-            values[i] = log(values[i]);
+// Points without data repeat the previous one
+static void smooth_exp2(output_context* out_ctx, real_t** output_buffer_p, real_t* min_p, real_t* max_p) {
+    real_t* acc_buffer = out_ctx->acc_buffer;
+    real_t* smooth_buffer = out_ctx->smooth_buffer;
+    real_t local_min = INFINITY, local_max = 0;
+
+    for (unsigned int i = 0; i < out_ctx->num_points; ++i) {
+        if (out_ctx->acc_buffer_data_count[i]) {
+            real_t new_value = max((smooth_buffer[i] * out_ctx->smoothing_old_value_factor + acc_buffer[i] * out_ctx->smoothing_new_value_factor), 0);
+            local_min = min(local_min, new_value);
+            local_max = max(local_max, new_value);
+            smooth_buffer[i] = new_value;
+        } else if (i > 0) {
+            smooth_buffer[i] = smooth_buffer[i-1];
         }
     }
+    smooth_limits(out_ctx, local_min, local_max, output_buffer_p, min_p, max_p);
 }
 
-void accumulate(output_context* out_ctx, double* values) {
-    unsigned int i;
-    double* acc_buffer = out_ctx->acc_buffer;
+// Every point has data: a straight loop with min/max reductions
+static void smooth_exp2_dense(output_context* out_ctx, real_t** output_buffer_p, real_t* min_p, real_t* max_p) {
+    const real_t* restrict acc_buffer = out_ctx->acc_buffer;
+    real_t* restrict smooth_buffer = out_ctx->smooth_buffer;
+    real_t old_factor = out_ctx->smoothing_old_value_factor;
+    real_t new_factor = out_ctx->smoothing_new_value_factor;
+    real_t local_min = INFINITY, local_max = 0;
+
+    for (unsigned int i = 0; i < out_ctx->num_points; ++i) {
+        real_t new_value = smooth_buffer[i] * old_factor + acc_buffer[i] * new_factor;
+        new_value = new_value > 0 ? new_value : 0;
+        local_min = new_value < local_min ? new_value : local_min;
+        local_max = new_value > local_max ? new_value : local_max;
+        smooth_buffer[i] = new_value;
+    }
+    smooth_limits(out_ctx, local_min, local_max, output_buffer_p, min_p, max_p);
+}
+
+///// Render
+
+// Glyph level of a normalized point: thresholds at or below it (NaN is 0)
+static inline unsigned char quantize_level(const real_t* thresholds, unsigned int n_thresholds, real_t level) {
+    unsigned char quantized = 0;
+    for (unsigned int k = 0; k < n_thresholds; ++k) {
+        quantized += level >= thresholds[k];
+    }
+    return quantized;
+}
+
+// Points to levels, in data order. Four points are compared against each
+// threshold at once when possible. The extra level pads an incomplete last
+// char, as a point at the minimum
+static void quantize(output_context* out_ctx, unsigned char* restrict levels) {
+    const real_t* restrict output_buffer = out_ctx->output_buffer;
+    real_t thresholds[OUTPUT_MAX_LEVELS - 1]; // Copied, as the (char) levels could alias them
+    memcpy(thresholds, out_ctx->level_thresholds, sizeof thresholds);
+    unsigned int n_thresholds = out_ctx->visualization_levels - 1;
     unsigned int num_points = out_ctx->num_points;
+    real_t min = out_ctx->output_min;
+    real_t inv_range = 1 / (out_ctx->output_max - min);
+    unsigned int i = 0;
+
+#ifndef DOUBLE_PRECISION
+#if defined(__SSE2__)
+    const __m128 min_v = _mm_set1_ps(min);
+    const __m128 inv_range_v = _mm_set1_ps(inv_range);
+    for (; i + 4 <= num_points; i += 4) {
+        __m128 level = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(output_buffer + i), min_v), inv_range_v);
+        __m128i count = _mm_setzero_si128();
+        for (unsigned int k = 0; k < n_thresholds; ++k) {
+            // Comparisons are all ones (-1) where true
+            count = _mm_sub_epi32(count, _mm_castps_si128(_mm_cmpge_ps(level, _mm_set1_ps(thresholds[k]))));
+        }
+        count = _mm_packs_epi32(count, count);
+        count = _mm_packus_epi16(count, count);
+        int packed = _mm_cvtsi128_si32(count);
+        memcpy(levels + i, &packed, sizeof packed);
+    }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    const float32x4_t min_v = vdupq_n_f32(min);
+    for (; i + 4 <= num_points; i += 4) {
+        float32x4_t level = vmulq_n_f32(vsubq_f32(vld1q_f32(output_buffer + i), min_v), inv_range);
+        uint32x4_t count = vdupq_n_u32(0);
+        for (unsigned int k = 0; k < n_thresholds; ++k) {
+            count = vsubq_u32(count, vcgeq_f32(level, vdupq_n_f32(thresholds[k])));
+        }
+        uint16x4_t narrow = vmovn_u32(count);
+        uint8x8_t bytes = vmovn_u16(vcombine_u16(narrow, narrow));
+        vst1_lane_u32((uint32_t*) (levels + i), vreinterpret_u32_u8(bytes), 0);
+    }
+#endif
+#endif
 
-    for (i = 0; i < num_points; ++i) {
-        acc_buffer[i] = 0;
+    for (; i < num_points; ++i) {
+        levels[i] = quantize_level(thresholds, n_thresholds, (output_buffer[i] - min) * inv_range);
     }
+    levels[num_points] = quantize_level(thresholds, n_thresholds, 0);
+}
+
+// Levels to glyphs in display order, mirrored kernels read the levels
+// backwards. Pairs (braille) index the glyphs by first * levels + second
+#define OUTPUT_GLYPH_KERNELS(single, pair, MIRRORED)                                     \
+static size_t single(output_context* out_ctx, const unsigned char* levels, char* buffer) { \
+    const output_glyph* glyphs = out_ctx->visualization_glyphs;                          \
+    unsigned int num_points = out_ctx->num_points;                                       \
+    char* buffer_start = buffer;                                                         \
+    for (unsigned int i = 0; i < num_points; ++i) {                                      \
+        const output_glyph* glyph = &glyphs[levels[MIRRORED ? num_points - 1 - i : i]];  \
+        memcpy(buffer, glyph->bytes, sizeof glyph->bytes);                               \
+        buffer += glyph->length;                                                         \
+    }                                                                                    \
+    return buffer - buffer_start;                                                        \
+}                                                                                        \
+                                                                                         \
+static size_t pair(output_context* out_ctx, const unsigned char* levels, char* buffer) { \
+    const output_glyph* glyphs = out_ctx->visualization_glyphs;                          \
+    unsigned int n_levels = out_ctx->visualization_levels;                               \
+    unsigned int num_points = out_ctx->num_points;                                       \
+    char* buffer_start = buffer;                                                         \
+    unsigned int i = 0;                                                                  \
+    for (; i + 1 < num_points; i += 2) {                                                 \
+        unsigned int first = levels[MIRRORED ? num_points - 1 - i : i];                  \
+        unsigned int second = levels[MIRRORED ? num_points - 2 - i : i + 1];             \
+        const output_glyph* glyph = &glyphs[first * n_levels + second];                  \
+        memcpy(buffer, glyph->bytes, sizeof glyph->bytes);                               \
+        buffer += glyph->length;                                                         \
+    }                                                                                    \
+    if (i < num_points) {                                                                \
+        const output_glyph* glyph = &glyphs[levels[MIRRORED ? 0 : i] * n_levels + levels[num_points]]; \
+        memcpy(buffer, glyph->bytes, sizeof glyph->bytes);                               \
+        buffer += glyph->length;                                                         \
+    }                                                                                    \
+    return buffer - buffer_start;                                                        \
+}
+
+OUTPUT_GLYPH_KERNELS(glyphs_single, glyphs_pair, 0)
+OUTPUT_GLYPH_KERNELS(glyphs_single_mirrored, glyphs_pair_mirrored, 1)
+
+static void output_select_kernels(output_context* out_ctx) {
+    out_ctx->transform_kernel = ((out_ctx->transform_flags & OUTPUT_LOGARITMIC_TRANSFORM) && !out_ctx->log_input) ? transform_log : transform_none;
 
     switch (out_ctx->group_func) {
         case OUTPUT_MAX_GROUPING_FUNC:
-            for (i = out_ctx->min_data_index; i <= out_ctx->max_data_index; ++i) {
-                double value = values[i];
-                unsigned int acc_index = out_ctx->data_buffer_index_to_acc_buffer_index[i];
-
-                acc_buffer[acc_index] = max(acc_buffer[acc_index], value);
-            }
+            out_ctx->accumulate_kernel = accumulate_max; // Clamps at 0, even ungrouped
             break;
         case OUTPUT_AVG_GROUPING_FUNC:
-            for (i = out_ctx->min_data_index; i <= out_ctx->max_data_index; ++i) {
-                double value = values[i];
-                unsigned int acc_index = out_ctx->data_buffer_index_to_acc_buffer_index[i];
-                acc_buffer[acc_index] += value;
-            }
-
-            for (i = 0; i < num_points; ++i) {
-                acc_buffer[i] *= out_ctx->acc_buffer_avg_factor[i];
-            }
+            out_ctx->accumulate_kernel = out_ctx->no_grouping ? accumulate_copy : accumulate_avg;
             break;
         case OUTPUT_NO_GROUPING_FUNC:
         default:
-            for (i = out_ctx->min_data_index; i <= out_ctx->max_data_index; ++i) {
-                double value = values[i];
-                unsigned int acc_index = out_ctx->data_buffer_index_to_acc_buffer_index[i];
-                acc_buffer[acc_index] = value;
-            }
+            out_ctx->accumulate_kernel = accumulate_copy; // Never grouped without a function
     }
-}
-
-void smooth(output_context* out_ctx, double** output_buffer_p, double* min_p, double* max_p) {
-    double* acc_buffer = out_ctx->acc_buffer;
-    double* smooth_buffer = out_ctx->smooth_buffer;
-    double local_min = INFINITY, local_max = 0;
 
     switch (out_ctx->smoothing) {
         case OUTPUT_EXP2_SMOOTH:
-            for (unsigned int i = 0; i < out_ctx->num_points; ++i) {
-                if (out_ctx->acc_buffer_data_count[i]) {
-                    double new_value = max((smooth_buffer[i] * out_ctx->smoothing_old_value_factor + acc_buffer[i] * out_ctx->smoothing_new_value_factor), 0);
-                    local_min = min(local_min, new_value);
-                    local_max = max(local_max, new_value);
-                    smooth_buffer[i] = new_value;
-                } else if (i > 0) {
-                    smooth_buffer[i] = smooth_buffer[i-1];
-                }
-            }
-
-            *min_p = out_ctx->smoothing_min_limit * out_ctx->smoothing_old_limit_factor + local_min * out_ctx->smoothing_new_limit_factor;
-            *max_p = out_ctx->smoothing_max_limit * out_ctx->smoothing_old_limit_factor + local_max * out_ctx->smoothing_new_limit_factor;
-            *output_buffer_p = smooth_buffer;
-
-            out_ctx->smoothing_min_limit = *min_p;
-            out_ctx->smoothing_max_limit = *max_p;
-
+            out_ctx->smooth_kernel = out_ctx->all_points_fed ? smooth_exp2_dense : smooth_exp2;
             break;
-
         case OUTPUT_NO_SMOOTH:
         default:
-            *min_p = out_ctx->abs_min;
-            *max_p = out_ctx->abs_max;
-            *output_buffer_p = acc_buffer;
+            out_ctx->smooth_kernel = smooth_none;
     }
+
+    if (out_ctx->visualization_points_per_char == 2) {
+        out_ctx->glyph_kernel = out_ctx->mirrored ? glyphs_pair_mirrored : glyphs_pair;
+    } else {
+        out_ctx->glyph_kernel = out_ctx->mirrored ? glyphs_single_mirrored : glyphs_single;
+    }
+}
+
+// Stages, also used by the benchmark
+void transform(output_context* out_ctx, real_t* values) {
+    out_ctx->transform_kernel(out_ctx, values);
+}
+
+void accumulate(output_context* out_ctx, real_t* values) {
+    out_ctx->accumulate_kernel(out_ctx, values);
+}
+
+void smooth(output_context* out_ctx, real_t** output_buffer_p, real_t* min_p, real_t* max_p) {
+    out_ctx->smooth_kernel(out_ctx, output_buffer_p, min_p, max_p);
 }
 
-wchar_t* output_print(output_context* out_ctx, double* values) {
+void output_update(output_context* out_ctx, real_t* values) {
 
     transform(out_ctx, values);
 
     accumulate(out_ctx, values);
 
-    double* output_buffer;
-    double min, max;
-    smooth(out_ctx, &output_buffer, &min, &max);
-
-    // SCALE & PRINT TO BUFFER
-    unsigned int num_points = out_ctx->num_points;
-    unsigned int levels = out_ctx->visualization_levels;
-    unsigned int points_per_char = out_ctx->visualization_points_per_char;
-    wchar_t* symbols = out_ctx->visualization_str;
-
-    unsigned int wchar_index = -1;
-    wchar_t* wchar_buffer = out_ctx->wchar_buffer;
-    for (unsigned int i = 0; i < num_points; i += points_per_char) {
-        unsigned int current_point = 0;
-        unsigned int current_symbol_index = 0;
-        for (current_point = 0; current_point < points_per_char; ++current_point) {
-            double level = 0;
-            if (i + current_point < num_points) {
-                level = ((output_buffer[i+current_point] - min) / (max - min)); // Range [0,1]
-            }
+    smooth(out_ctx, &out_ctx->output_buffer, &out_ctx->output_min, &out_ctx->output_max);
+}
 
-            if (out_ctx->sigmoid_scaling_factor > 0) {
-                level = 1/(1+exp(-out_ctx->sigmoid_scaling_factor * (level - 0.5)));
-            }
+const real_t* output_values(output_context* out_ctx, unsigned int* num_points, real_t* min, real_t* max) {
+    *num_points = out_ctx->num_points;
+    *min = out_ctx->output_min;
+    *max = out_ctx->output_max;
+    return out_ctx->output_buffer;
+}
 
-            int f_ranged = (level * out_ctx->lineal_scaling_factor) * levels;
-            f_ranged = max(f_ranged, 0);
-            f_ranged = min(f_ranged, levels -1);
-            current_symbol_index *= levels;
-            current_symbol_index += f_ranged;
-        }
-        wchar_buffer[++wchar_index] = symbols[current_symbol_index]; // wchar_index != i for multipoint chars
-    }
-    wchar_buffer[++wchar_index] = '\0';
-    return wchar_buffer;
+size_t output_render(output_context* out_ctx, char* buffer) {
+    quantize(out_ctx, out_ctx->level_buffer);
+    return out_ctx->glyph_kernel(out_ctx, out_ctx->level_buffer, buffer);
 }
 
+size_t output_print(output_context* out_ctx, real_t* values, char* buffer) {
+    output_update(out_ctx, values);
+    return output_render(out_ctx, buffer);
+}
@@ -1,7 +1,9 @@
 #ifndef WCHAR_OUTPUT_H
 #define WCHAR_OUTPUT_H
 
-#include <wchar.h>
+#include "precision.h"
+
+#include <stddef.h>
 
 #define OUTPUT_NO_GROUPING         0U
 #define OUTPUT_LINEAL_GROUPING     1U
@@ -18,7 +20,7 @@ typedef struct output_context output_context;
 
 output_context* output_init(
         unsigned int data_length,
-        double* data_frequency,
+        const double* data_frequency,  // Copied
         unsigned int min_freq,
         unsigned int max_freq,
         unsigned int num_points,
@@ -29,6 +31,13 @@ output_context* output_init(
         unsigned int transform_flags
         );
 
+// Regroups the data (same arguments as output_init) between frames. Only the
+// data -> point tables are rebuilt, O(data_length), and the per point buffers
+// only grow past data_length points. Smoothing starts over and
+// output_line_max_length may change. Returns -1, with the grouping
+// unchanged, if the buffers cannot grow
+int output_set_grouping(output_context* out_ctx, unsigned int min_freq, unsigned int max_freq, unsigned int num_points, int group, int group_func);
+
 void output_set_lineal_scale_factor_offset(output_context* out_ctx, double offset);
 
 void output_set_sigmoid_scale_factor(output_context* out_ctx, double factor);
@@ -38,7 +47,15 @@ void output_set_sigmoid_scale_factor(output_context* out_ctx, double factor);
 #define OUTPUT_CHARSET_BRAILLE_WIDE 3U
 void output_set_charset(output_context* out_ctx, int charset);
 
-void output_set_silence_str(output_context* out_ctx, wchar_t* provided_silence_str);
+// Render from the highest to the lowest frequency (i.e. left channel)
+void output_set_mirrored(output_context* out_ctx, int mirrored);
+
+// Values passed to output_update are already log magnitudes (i.e. from
+// fft_log_magnitude), OUTPUT_LOGARITMIC_TRANSFORM only sets the limits
+void output_set_log_input(output_context* out_ctx, int log_input);
+
+// UTF-8, the string is not copied
+void output_set_silence_str(output_context* out_ctx, const char* provided_silence_str);
 
 #define OUTPUT_NO_SMOOTH   0U
 #define OUTPUT_EXP2_SMOOTH 1U
@@ -47,9 +64,31 @@ void output_set_smoothing_factors(output_context* out_ctx, double new_value_fact
 
 void output_deinit(output_context* out_ctx);
 
-wchar_t* output_print_silence(output_context* out_ctx);
+// Points drawn by each char of the line, it depends on the charset
+unsigned int output_points_per_char(output_context* out_ctx);
+
+// Range of data indexes that are displayed, the rest are never read
+void output_data_range(output_context* out_ctx, unsigned int* min_data_index, unsigned int* max_data_index);
+
+// Output is UTF-8, not null terminated. Buffers passed to the functions
+// below must have room for output_line_max_length bytes, they return the
+// length of the line
+size_t output_line_max_length(output_context* out_ctx);
+
+size_t output_print_silence(output_context* out_ctx, char* buffer);
+
+// Update the displayed values with new data (transform, group and smooth)
+void output_update(output_context* out_ctx, real_t* values);
+
+// Last updated values (low to high frequency) and the limits they are
+// mapped to chars with
+const real_t* output_values(output_context* out_ctx, unsigned int* num_points, real_t* min, real_t* max);
+
+// Map the last updated values to chars
+size_t output_render(output_context* out_ctx, char* buffer);
 
-wchar_t* output_print(output_context* out_ctx, double* values);
+// output_update + output_render
+size_t output_print(output_context* out_ctx, real_t* values, char* buffer);
 
 #endif
 
@@ -0,0 +1,11 @@
+#ifndef OUTPUT_INTERNAL_H
+#define OUTPUT_INTERNAL_H
+
+// Stages of output_update, only for output.c and the benchmark
+#include "output.h"
+
+void transform(output_context* out_ctx, real_t* values);
+void accumulate(output_context* out_ctx, real_t* values);
+void smooth(output_context* out_ctx, real_t** output_buffer_p, real_t* min_p, real_t* max_p);
+
+#endif
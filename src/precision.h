@@ -0,0 +1,16 @@
+#ifndef PRECISION_H
+#define PRECISION_H
+
+// Samples and spectra are single precision (the input is 16 bit PCM),
+// build with DOUBLE_PRECISION defined (make DOUBLE=1) to use doubles
+#ifdef DOUBLE_PRECISION
+typedef double real_t;
+#define FFTW(name) fftw_ ## name
+#define PRECISION_NAME "double"
+#else
+typedef float real_t;
+#define FFTW(name) fftwf_ ## name
+#define PRECISION_NAME "float"
+#endif
+
+#endif
@@ -23,13 +23,21 @@
    Version: 1.0.0
 */
 
+#include "pulseaudio_follow_sink.h"
+
+#include <pthread.h>
 #include <pulse/pulseaudio.h>
+#include <stdatomic.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
 #define UNUSED(x) (void)(x)
 
+// Peaks below one S16 step are silence
+#define PEAK_SOUND_THRESHOLD (1.0F / 32768)
+
 typedef struct state_t {
     char monitor_source_name[256];
     uint32_t running_index;
@@ -38,21 +46,36 @@ typedef struct state_t {
     uint32_t current_stream_source_index;
     pa_mainloop_api* pa_mainloop_api;
     pa_stream* stream;
-    const pa_sample_spec* sample_spec;
-    const pa_buffer_attr* buffer_attr;
+    pa_sample_spec sample_spec;
+    pa_buffer_attr buffer_attr;
 
     // Output information, to use in stream callbacks
-    unsigned int write_index;
-    unsigned int buffer_silence;
-    unsigned int n_samples;
-    double* output_buffer;
-    int (*output_cb)(int, void*);
-    void* output_userdata;
-
-    // Need to store that a flush is undergoing
-    unsigned int flush_in_progress;
+    spsc_ring* ring;
+
+    // Low latency mode: the fragment size is requested (and doubled on
+    // overflows), otherwise the server chooses it
+    uint32_t low_latency;
+    atomic_uint overflows;
+    atomic_uint holes;                 // Frames, bigger fragments would not help
+    atomic_uint_least64_t latency_us;
+    atomic_uint fragsize;
+
+    // Idle mode: the stream is corked and a peak detection stream at a very
+    // low rate tells when there's sound again
+    atomic_int idle_requested;
+    uint32_t idle;
+    pa_stream* peak_stream;
+    pa_sample_spec peak_sample_spec;
+    pa_buffer_attr peak_buffer_attr;
 } state_t;
 
+struct pa_follow_sink {
+    pthread_t thread;
+    atomic_int quit_requested;
+    pa_mainloop* pa_mainloop;
+    state_t state;
+};
+
 void reset_state(state_t* state) {
     state->monitor_source_name[0] = '\0';
     state->monitor_source_name[255] = '\0';
@@ -62,17 +85,18 @@ void reset_state(state_t* state) {
     state->current_stream_source_index = PA_INVALID_INDEX;
     state->pa_mainloop_api = NULL;
     state->stream = NULL;
-    state->sample_spec = NULL;
-    state->buffer_attr = NULL;
 
-    state->write_index = 0;
-    state->buffer_silence = 1;
-    state->n_samples = 0;
-    state->output_buffer = NULL;
-    state->output_cb = NULL;
-    state->output_userdata = NULL;
+    state->ring = NULL;
+
+    state->low_latency = 0;
+    atomic_init(&state->overflows, 0);
+    atomic_init(&state->holes, 0);
+    atomic_init(&state->latency_us, 0);
+    atomic_init(&state->fragsize, 0);
 
-    state->flush_in_progress = 0;
+    atomic_init(&state->idle_requested, 0);
+    state->idle = 0;
+    state->peak_stream = NULL;
 }
 
 static state_t* get_state_from_userdata(void* userdata) {
@@ -83,21 +107,63 @@ static void quit(state_t* state_p, int ret_value) {
     state_p->pa_mainloop_api->quit(state_p->pa_mainloop_api, ret_value);
 }
 
+static void unref_operation(pa_operation* operation) {
+    if (operation) {
+        pa_operation_unref(operation);
+    }
+}
+
 // This is for the stream //
-static void pa_stream_flush_cb(pa_stream* s, int success, void *userdata) {
-    UNUSED(s);
-    UNUSED(success);
-    get_state_from_userdata(userdata)->flush_in_progress = 0;
+static void store_buffer_attr(state_t* state_p, pa_stream* s) {
+    const pa_buffer_attr* buffer_attr = pa_stream_get_buffer_attr(s);
+    if (buffer_attr) {
+        atomic_store(&state_p->fragsize, buffer_attr->fragsize);
+    }
+}
+
+static void pa_stream_buffer_attr_cb(pa_stream* s, int success, void* userdata) {
+    if (success) {
+        store_buffer_attr(get_state_from_userdata(userdata), s);
+    }
 }
+
+// Counts the overflow and, in low latency mode, asks for fragments twice as
+// big, as long as they are at most half the buffer (a window), so it
+// doesn't happen again. Fragments of a hop longer than a quarter window
+// are already as big as they get. Only the record stream has it set
+static void pa_stream_overflow_cb(pa_stream* s, void* userdata) {
+    state_t* state_p = get_state_from_userdata(userdata);
+    atomic_fetch_add(&state_p->overflows, 1);
+
+    if (state_p->low_latency && state_p->buffer_attr.fragsize * 2 <= state_p->buffer_attr.maxlength / 2) {
+        state_p->buffer_attr.fragsize *= 2;
+#ifdef DEBUG
+        fprintf(stderr, "PA: Overflow, fragsize is now %u\n", state_p->buffer_attr.fragsize);
+#endif
+        unref_operation(pa_stream_set_buffer_attr(s, &state_p->buffer_attr, pa_stream_buffer_attr_cb, state_p));
+    }
+}
+
 static void pa_stream_state_cb(pa_stream* s, void* userdata) {
     state_t* state_p = get_state_from_userdata(userdata);
     switch (pa_stream_get_state(s)) {
+        case PA_STREAM_READY:
+            if (state_p->stream == s) {
+                store_buffer_attr(state_p, s);
+            }
+            break;
         case PA_STREAM_FAILED:
         case PA_STREAM_TERMINATED:
             if (state_p->stream == s) {
                 pa_stream_disconnect(state_p->stream);
                 pa_stream_unref(state_p->stream);
                 state_p->stream = NULL;
+            } else if (state_p->peak_stream == s) {
+                pa_stream_disconnect(state_p->peak_stream);
+                pa_stream_unref(state_p->peak_stream);
+                state_p->peak_stream = NULL;
+                // Nothing can tell when there's sound, update_idle uncorks
+                atomic_store(&state_p->idle_requested, 0);
             }
         default:
             break;
@@ -116,46 +182,117 @@ static void pa_stream_read_cb(pa_stream* s, size_t length, void* userdata) {
             return;
         }
 
-        if (data && !state_p->flush_in_progress) {
-            if (((uint64_t) data & 1U) == 0) {
-                int16_t* pa_buffer = (int16_t*) data;
-                length /= 2;
-                double* amplitude_samples = state_p->output_buffer;
-                unsigned int n_samples = state_p->n_samples;
-                int i = 0;
-
-                while (length) {
-                    unsigned int limit = n_samples;
-                    if (limit > state_p->write_index + length) {
-                        limit = state_p->write_index + length;
-                        length = 0;
-                    } else {
-                        length -= (n_samples - state_p->write_index);
-                    }
+        // The capture thread only copies, processing happens in the consumer
+        // thread. data is NULL if there is a hole in the stream, that is,
+        // the server dropped samples
+        if (data) {
+            spsc_ring_push(state_p->ring, data, length);
+        } else {
+            atomic_fetch_add(&state_p->holes, length / pa_frame_size(&state_p->sample_spec));
+        }
 
-                    for (; state_p->write_index < limit; ++i, ++state_p->write_index) {
-                        amplitude_samples[state_p->write_index] = pa_buffer[i];
-                        state_p->buffer_silence = state_p->buffer_silence && !pa_buffer[i];
-                    }
+        pa_stream_drop(s);
 
-                    if (state_p->write_index == n_samples) {
-                        unsigned int wait_time_ms = state_p->output_cb(state_p->buffer_silence, state_p->output_userdata);
-                        state_p->write_index = 0;
-                        state_p->buffer_silence = 1;
-                        if (wait_time_ms) {
-                            sleep(wait_time_ms / 1000); //FIXME Change flush and sleep for cork/uncork
-                            state_p->flush_in_progress = 1;
-                            pa_stream_flush(s, pa_stream_flush_cb, userdata);
-                            break;
-                        }
-                    } else {
-                        break;
-                    }
-                }
+        // Interpolated, no round trip to the server
+        pa_usec_t latency;
+        int negative;
+        if (pa_stream_get_latency(s, &latency, &negative) == 0) {
+            atomic_store_explicit(&state_p->latency_us, negative ? 0 : latency, memory_order_relaxed);
+        }
+    }
+}
+
+static void pa_peak_stream_read_cb(pa_stream* s, size_t length, void* userdata) {
+    state_t* state_p = get_state_from_userdata(userdata);
+    const void* data;
+
+    if (pa_stream_peek(s, &data, &length) < 0 || !length) {
+        return;
+    }
+
+    if (data) {
+        for (size_t i = 0; i + sizeof(float) <= length; i += sizeof(float)) {
+            float peak;
+            memcpy(&peak, (const char*) data + i, sizeof peak);
+            if (peak >= PEAK_SOUND_THRESHOLD) {
+                // Handled in the mainloop, after this callback
+                atomic_store(&state_p->idle_requested, 0);
+                break;
             }
         }
+    }
 
-        pa_stream_drop(s);
+    pa_stream_drop(s);
+}
+
+// overflow_cb may be NULL, i.e. peaks are not worth counting. Returns NULL
+// if the stream cannot be created or connected
+static pa_stream* connect_stream(state_t* state_p, pa_context* pa_context, const char* name, const pa_sample_spec* sample_spec, const pa_buffer_attr* buffer_attr, pa_stream_flags_t flags, pa_stream_request_cb_t read_cb, pa_stream_notify_cb_t overflow_cb) {
+    pa_stream* stream;
+    if (!(stream = pa_stream_new(pa_context, name, sample_spec, NULL))) {
+        fprintf(stderr, "PA: Cannot create stream: %s\n", pa_strerror(pa_context_errno(pa_context)));
+        return NULL;
+    }
+#ifdef DEBUG
+    fprintf(stderr, "PA: Connect stream %s\n", name);
+#endif
+    pa_stream_set_state_callback(stream, pa_stream_state_cb, state_p);
+    pa_stream_set_read_callback(stream, read_cb, state_p);
+    if (overflow_cb) {
+        pa_stream_set_overflow_callback(stream, overflow_cb, state_p);
+    }
+
+    if (pa_stream_connect_record(stream, state_p->monitor_source_name, buffer_attr, flags) < 0) {
+        fprintf(stderr, "PA: Cannot connect to source %s: %s\n", state_p->monitor_source_name, pa_strerror(pa_context_errno(pa_context)));
+        pa_stream_unref(stream); // It would never be ready
+        return NULL;
+    }
+    return stream;
+}
+
+static void stop_peak_stream(state_t* state_p) {
+    if (state_p->peak_stream) {
+        pa_stream_disconnect(state_p->peak_stream);
+        pa_stream_unref(state_p->peak_stream);
+        state_p->peak_stream = NULL;
+    }
+}
+
+static void start_peak_stream(state_t* state_p, pa_context* pa_context) {
+    stop_peak_stream(state_p);
+    if (state_p->stream) {
+        state_p->peak_stream = connect_stream(state_p, pa_context, "terminal pulseaudio spectrum peak stream",
+                &state_p->peak_sample_spec, &state_p->peak_buffer_attr, PA_STREAM_PEAK_DETECT | PA_STREAM_ADJUST_LATENCY, pa_peak_stream_read_cb, NULL);
+        if (!state_p->peak_stream) {
+            atomic_store(&state_p->idle_requested, 0); // Cannot detect sound, stay awake
+        }
+    }
+}
+
+// Corks the stream while idle is requested, uncorks it as soon as the peak
+// stream detects sound
+static void update_idle(state_t* state_p, pa_context* pa_context) {
+    unsigned int idle_requested = atomic_load(&state_p->idle_requested);
+
+    if (idle_requested && !state_p->idle) {
+#ifdef DEBUG
+        fprintf(stderr, "PA: Going idle\n");
+#endif
+        state_p->idle = 1;
+        if (state_p->stream) {
+            unref_operation(pa_stream_cork(state_p->stream, 1, NULL, NULL));
+        }
+        start_peak_stream(state_p, pa_context);
+    } else if (!idle_requested && state_p->idle) {
+#ifdef DEBUG
+        fprintf(stderr, "PA: Waking up\n");
+#endif
+        state_p->idle = 0;
+        stop_peak_stream(state_p);
+        if (state_p->stream) {
+            unref_operation(pa_stream_flush(state_p->stream, NULL, NULL)); // Drop what was buffered before corking
+            unref_operation(pa_stream_cork(state_p->stream, 0, NULL, NULL));
+        }
     }
 }
 ////////////////////////////
@@ -228,37 +365,18 @@ static void pa_context_sink_list_cb(pa_context* c, const pa_sink_info* i, int eo
     }
 }
 
-void pa_set_up_read_callback(unsigned int n_samples, unsigned int sample_rate, double* output_buffer, int(*output_cb)(int, void*), void* output_userdata) {
-    state_t state;
-    state_t* state_p = &state;
-    reset_state(state_p);
-
-    state_p->n_samples = n_samples;
-    state_p->output_buffer = output_buffer;
-    state_p->output_cb = output_cb;
-    state_p->output_userdata = output_userdata;
-
-    const pa_sample_spec sample_spec = {
-        .format = PA_SAMPLE_S16LE,
-        .rate =  sample_rate,
-        .channels = 1
-    };
-    const pa_buffer_attr buffer_attr = {
-        .maxlength = sizeof(int16_t) * n_samples,
-        .fragsize = -1
-    };
-    state_p->sample_spec = &sample_spec;
-    state_p->buffer_attr = &buffer_attr;
+static void* capture_thread(void* userdata) {
+    pa_follow_sink* sink = (pa_follow_sink*) userdata;
+    state_t* state_p = &sink->state;
 
     pa_operation* pa_operation = NULL;
-    pa_mainloop* pa_mainloop = pa_mainloop_new();
-    state_p->pa_mainloop_api = pa_mainloop_get_api(pa_mainloop);
+    pa_mainloop* pa_mainloop = sink->pa_mainloop;
     pa_context* pa_context = pa_context_new(state_p->pa_mainloop_api, "terminal pulseaudio spectrum");
 
     pa_context_connect(pa_context, NULL, 0, NULL);
 
     pa_context_set_state_callback(pa_context, pa_context_state_cb, state_p);
-    while (pa_mainloop_iterate(pa_mainloop, 1, NULL) >= 0) {
+    while (!atomic_load(&sink->quit_requested) && pa_mainloop_iterate(pa_mainloop, 1, NULL) >= 0) {
         if (state_p->pa_context_ready) {
             if (!state_p->found && !pa_operation) {
                 pa_operation = pa_context_get_sink_info_list(pa_context, pa_context_sink_list_cb, state_p);
@@ -290,30 +408,34 @@ void pa_set_up_read_callback(unsigned int n_samples, unsigned int sample_rate, d
 #ifdef DEBUG
                     fprintf(stderr, "PA: Create stream\n");
 #endif
-                    if (!(state_p->stream = pa_stream_new(pa_context, "terminal pulseaudio spectrum stream", state_p->sample_spec, NULL))) {
-                        fprintf(stderr, "PA: Cannot create stream: %s\n", pa_strerror(pa_context_errno(pa_context)));
+                    pa_stream_flags_t flags = PA_STREAM_INTERPOLATE_TIMING | PA_STREAM_AUTO_TIMING_UPDATE;
+                    if (state_p->low_latency) {
+                        flags |= PA_STREAM_ADJUST_LATENCY;
+                    }
+                    if (state_p->idle) {
+                        flags |= PA_STREAM_START_CORKED;
+                    }
+                    state_p->stream = connect_stream(state_p, pa_context, "terminal pulseaudio spectrum stream",
+                            &state_p->sample_spec, &state_p->buffer_attr, flags, pa_stream_read_cb, pa_stream_overflow_cb);
+                    if (!state_p->stream) {
                         quit(state_p, 0);
-                    } else {
-#ifdef DEBUG
-                    fprintf(stderr, "PA: Connect stream\n");
-#endif
-                        pa_stream_set_state_callback(state_p->stream, pa_stream_state_cb, state_p);
-                        pa_stream_set_read_callback(state_p->stream, pa_stream_read_cb, state_p);
-
-                        if (pa_stream_connect_record(state_p->stream, state_p->monitor_source_name, state_p->buffer_attr, 0) < 0) {
-                            fprintf(stderr, "PA: Cannot connect to source %s: %s\n", state_p->monitor_source_name, pa_strerror(pa_context_errno(pa_context)));
-                        }
                     }
-                } else {
-                    state_p->output_cb(1, state_p->output_userdata);
+                }
+
+                // While idle, the peak stream follows the monitor source
+                if (state_p->idle) {
+                    start_peak_stream(state_p, pa_context);
                 }
                 ////////////////////////////
 
                 state_p->current_stream_source_index = state_p->running_index;
             }
+
+            update_idle(state_p, pa_context);
         }
     }
 
+    stop_peak_stream(state_p);
     if (state_p->stream) {
         pa_stream_disconnect(state_p->stream);
         pa_stream_unref(state_p->stream);
@@ -322,6 +444,71 @@ void pa_set_up_read_callback(unsigned int n_samples, unsigned int sample_rate, d
 
     pa_context_disconnect(pa_context);
     pa_context_unref(pa_context);
-    pa_mainloop_free(pa_mainloop);
+
+    spsc_ring_close(state_p->ring);
+    return NULL;
+}
+
+pa_follow_sink* pa_follow_sink_start(unsigned int n_samples, unsigned int fragment_samples, const pa_sample_spec* sample_spec, unsigned int probe_period_ms, spsc_ring* ring) {
+    pa_follow_sink* sink = NULL;
+    if ((sink = malloc(sizeof *sink))) {
+        state_t* state_p = &sink->state;
+        reset_state(state_p);
+
+        state_p->ring = ring;
+        state_p->sample_spec = *sample_spec;
+        state_p->buffer_attr = (pa_buffer_attr) {
+            .maxlength = pa_frame_size(sample_spec) * n_samples,
+            .fragsize = fragment_samples ? pa_frame_size(sample_spec) * fragment_samples : (uint32_t) -1
+        };
+        state_p->low_latency = fragment_samples != 0;
+
+        // One peak per probe period, the nearest rate, 1 Hz at least
+        unsigned int probe_rate = probe_period_ms ? (1000 + probe_period_ms / 2) / probe_period_ms : 0;
+        state_p->peak_sample_spec = (pa_sample_spec) {
+            .format = PA_SAMPLE_FLOAT32LE,
+            .rate = probe_rate ? probe_rate : 1,
+            .channels = 1
+        };
+        state_p->peak_buffer_attr = (pa_buffer_attr) {
+            .maxlength = -1,
+            .fragsize = sizeof(float) // Deliver every peak
+        };
+
+        atomic_init(&sink->quit_requested, 0);
+        sink->pa_mainloop = pa_mainloop_new();
+        state_p->pa_mainloop_api = pa_mainloop_get_api(sink->pa_mainloop);
+
+        if (pthread_create(&sink->thread, NULL, capture_thread, sink)) {
+            fprintf(stderr, "PA: Cannot create capture thread\n");
+            pa_mainloop_free(sink->pa_mainloop);
+            free(sink);
+            sink = NULL;
+        }
+    }
+    return sink;
+}
+
+void pa_follow_sink_idle(pa_follow_sink* sink) {
+    atomic_store(&sink->state.idle_requested, 1);
+    pa_mainloop_wakeup(sink->pa_mainloop);
+}
+
+void pa_follow_sink_get_stats(pa_follow_sink* sink, pa_follow_sink_stats* stats) {
+    state_t* state_p = &sink->state;
+    *stats = (pa_follow_sink_stats) {
+        .overflows = atomic_load_explicit(&state_p->overflows, memory_order_relaxed),
+        .holes = atomic_load_explicit(&state_p->holes, memory_order_relaxed),
+        .latency_us = atomic_load_explicit(&state_p->latency_us, memory_order_relaxed),
+        .fragsize = atomic_load_explicit(&state_p->fragsize, memory_order_relaxed),
+    };
+}
+
+void pa_follow_sink_stop(pa_follow_sink* sink) {
+    atomic_store(&sink->quit_requested, 1);
+    pa_mainloop_wakeup(sink->pa_mainloop);
+    pthread_join(sink->thread, NULL);
+    pa_mainloop_free(sink->pa_mainloop);
+    free(sink);
 }
 
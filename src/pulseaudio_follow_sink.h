@@ -1,13 +1,43 @@
 #ifndef PULSEAUDIO_FOLLOW_SINK_H
 #define PULSEAUDIO_FOLLOW_SINK_H
 
-void pa_set_up_read_callback(
+#include "spsc_ring.h"
+
+#include <pulse/sample.h>
+#include <stdint.h>
+
+typedef struct pa_follow_sink pa_follow_sink;
+
+// Starts a capture thread that follows the running sink and pushes its
+// monitor samples, as described by sample_spec, into the ring (whole
+// frames, its frame size has to be pa_frame_size(sample_spec)). The ring is
+// closed when the capture thread finishes (i.e. PA context failure).
+// With fragment_samples, the stream is in low latency mode: that fragment
+// size is requested (PA_STREAM_ADJUST_LATENCY) and doubled on overflows,
+// up to half a window
+pa_follow_sink* pa_follow_sink_start(
         unsigned int n_samples,
-        unsigned int sample_rate,
-        double* buffer_to_use,
-        int(*output_cb)(int, void*),
-        void* output_userdata
+        unsigned int fragment_samples,   // 0 lets the server choose
+        const pa_sample_spec* sample_spec,
+        unsigned int probe_period_ms,    // Sound detection period while idle, up to 1000
+        spsc_ring* ring
         );
 
-#endif
+// Corks the stream until there's sound again (checked with a peak detection
+// stream every probe_period_ms, rounded to a whole number of peaks per
+// second), nothing is pushed in the meantime
+void pa_follow_sink_idle(pa_follow_sink* sink);
 
+typedef struct {
+    unsigned int overflows;  // Overflows of the record stream (events, not samples)
+    unsigned int holes;      // Frames missing in the record stream (holes)
+    uint64_t latency_us;     // Record latency (source + not yet read), 0 if unknown
+    uint32_t fragsize;       // Bytes, as negotiated with the server
+} pa_follow_sink_stats;
+
+// Safe to call from any thread
+void pa_follow_sink_get_stats(pa_follow_sink* sink, pa_follow_sink_stats* stats);
+
+void pa_follow_sink_stop(pa_follow_sink* sink);
+
+#endif
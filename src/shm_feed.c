@@ -0,0 +1,173 @@
+/*
+   This file is part of the 'term_pa_spectrum' program, which follows
+   a pulseaudio stream and displays its frequency spectrum through the
+   terminal.
+
+   Copyright (C) <2018> Jose Maria Perez Ramos
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.    See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.    If not, see <http://www.gnu.org/licenses/>.
+
+   Author: Jose Maria Perez Ramos <jose.m.perez.ramos+git gmail>
+   Date: 2018.08.13
+   Version: 1.0.0
+*/
+
+#include "shm_feed.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SHM_FEED_SLOTS 4U
+#define SHM_FEED_ALIGN(size) (((size) + 63U) & ~63U) // Cache lines
+
+// The layout is shared with other programs, so the atomic fields are plain
+// integers accessed with the __atomic builtins
+
+struct shm_feed {
+    char* path;
+    unsigned char* base;
+    size_t size;
+    shm_feed_header* header;
+    uint64_t frame;                // Being written, latest + 1
+    unsigned char* slot;           // NULL until the frame is started
+};
+
+shm_feed* shm_feed_open(const char* name, unsigned int flags, unsigned int channels, unsigned int n_points, unsigned int n_bins, const double* frequencies) {
+    if (!(flags & SHM_FEED_POINTS)) {
+        n_points = 0;
+    }
+    if (!(flags & SHM_FEED_SPECTRUM)) {
+        n_bins = 0;
+    }
+
+    size_t frequencies_offset = sizeof(shm_feed_header);
+    size_t slots_offset = SHM_FEED_ALIGN(frequencies_offset + n_bins * sizeof(float));
+    size_t slot_size = SHM_FEED_ALIGN(sizeof(shm_feed_slot) + channels * (sizeof(shm_feed_points) + (n_points + n_bins) * sizeof(float)));
+    size_t size = slots_offset + SHM_FEED_SLOTS * slot_size;
+
+    shm_feed* feed = calloc(1, sizeof *feed);
+    if (!feed || !(feed->path = malloc(strlen(name) + 2))) {
+        free(feed);
+        return NULL;
+    }
+    sprintf(feed->path, "%s%s", (name[0] == '/') ? "" : "/", name);
+
+    int fd = shm_open(feed->path, O_CREAT | O_RDWR | O_TRUNC, 0644);
+    if (fd < 0 || ftruncate(fd, size) < 0 || (feed->base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+        fprintf(stderr, "SHM: Cannot create %s: %s\n", feed->path, strerror(errno));
+        if (fd >= 0) {
+            close(fd);
+            shm_unlink(feed->path);
+        }
+        free(feed->path);
+        free(feed);
+        return NULL;
+    }
+    close(fd);
+
+    feed->size = size;
+    feed->header = (shm_feed_header*) feed->base;
+    feed->frame = 1;
+    *feed->header = (shm_feed_header) {
+        .version = SHM_FEED_VERSION,
+        .flags = flags,
+        .channels = channels,
+        .n_points = n_points,
+        .n_bins = n_bins,
+        .n_slots = SHM_FEED_SLOTS,
+        .slot_size = slot_size,
+        .frequencies_offset = frequencies_offset,
+        .slots_offset = slots_offset,
+    };
+    float* frequencies_out = (float*) (feed->base + frequencies_offset);
+    for (unsigned int i = 0; i < n_bins; ++i) {
+        frequencies_out[i] = frequencies[i];
+    }
+    // Last, readers may have mapped it already
+    __atomic_store_n(&feed->header->magic, SHM_FEED_MAGIC, __ATOMIC_RELEASE);
+
+    return feed;
+}
+
+void shm_feed_close(shm_feed* feed) {
+    munmap(feed->base, feed->size);
+    shm_unlink(feed->path);
+    free(feed->path);
+    free(feed);
+}
+
+// Marks the slot of the frame as being written
+static unsigned char* shm_feed_begin(shm_feed* feed) {
+    if (!feed->slot) {
+        const shm_feed_header* header = feed->header;
+        feed->slot = feed->base + header->slots_offset + (feed->frame % header->n_slots) * header->slot_size;
+        __atomic_store_n(&((shm_feed_slot*) feed->slot)->sequence, 2 * feed->frame - 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+    }
+    return feed->slot;
+}
+
+unsigned int shm_feed_max_points(shm_feed* feed) {
+    return feed->header->n_points;
+}
+
+void shm_feed_write_points(shm_feed* feed, unsigned int channel, const real_t* points, unsigned int n_points, real_t min, real_t max) {
+    const shm_feed_header* header = feed->header;
+    if (!header->n_points) {
+        return;
+    }
+    if (n_points > header->n_points) {
+        n_points = header->n_points;
+    }
+
+    unsigned char* slot = shm_feed_begin(feed);
+    shm_feed_points* info = (shm_feed_points*) (slot + sizeof(shm_feed_slot)) + channel;
+    float* out = (float*) (slot + sizeof(shm_feed_slot) + header->channels * sizeof(shm_feed_points)) + channel * header->n_points;
+
+    *info = (shm_feed_points) {.min = min, .max = max, .n_points = n_points};
+    for (unsigned int i = 0; i < n_points; ++i) {
+        out[i] = points[i];
+    }
+}
+
+void shm_feed_write_spectrum(shm_feed* feed, unsigned int channel, const real_t* spectrum) {
+    const shm_feed_header* header = feed->header;
+    if (!header->n_bins) {
+        return;
+    }
+
+    unsigned char* slot = shm_feed_begin(feed);
+    float* out = (float*) (slot + sizeof(shm_feed_slot) + header->channels * (sizeof(shm_feed_points) + header->n_points * sizeof(float))) + channel * header->n_bins;
+    for (unsigned int i = 0; i < header->n_bins; ++i) {
+        out[i] = spectrum[i];
+    }
+}
+
+void shm_feed_publish(shm_feed* feed) {
+    shm_feed_slot* slot = (shm_feed_slot*) shm_feed_begin(feed);
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    slot->time_ns = (uint64_t) ts.tv_sec * 1000000000U + ts.tv_nsec;
+
+    __atomic_store_n(&slot->sequence, 2 * feed->frame, __ATOMIC_RELEASE);
+    __atomic_store_n(&feed->header->latest, feed->frame, __ATOMIC_RELEASE);
+    feed->frame++;
+    feed->slot = NULL;
+}
@@ -0,0 +1,85 @@
+#ifndef SHM_FEED_H
+#define SHM_FEED_H
+
+#include "precision.h"
+
+#include <stdint.h>
+
+// Publishes every frame into a POSIX shared memory ring (/dev/shm/<name>),
+// so other programs (i.e. a widget) can map it and read the latest frame
+// without syscalls. Layout, all little endian, values are float32:
+//
+//   shm_feed_header
+//   float frequencies[n_bins]                 at frequencies_offset, Hz
+//   n_slots slots of slot_size bytes          at slots_offset, each:
+//     shm_feed_slot
+//     shm_feed_points points_info[channels]
+//     float points[channels][n_points]        Grouped and smoothed, low to high freq
+//     float spectrum[channels][n_bins]        Displayed bins, as fed to the output
+//
+// Reading (slots are seqlocks, the writer never waits for readers):
+//   frame = load_acquire(&header->latest)    // 0 before the first frame
+//   slot = slots + (frame % n_slots) * slot_size
+//   s1 = load_acquire(&slot->sequence)       // retry if s1 != 2 * frame
+//   copy what's needed, acquire fence
+//   s2 = load_relaxed(&slot->sequence)       // retry if s2 != s1
+
+#define SHM_FEED_MAGIC   0x31465053U // "SPF1"
+#define SHM_FEED_VERSION 1U
+
+#define SHM_FEED_POINTS       1U // Content
+#define SHM_FEED_SPECTRUM     2U
+#define SHM_FEED_LOG_SPECTRUM 4U // Flag: the spectrum holds log magnitudes
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t flags;                // SHM_FEED_POINTS | SHM_FEED_SPECTRUM | SHM_FEED_LOG_SPECTRUM
+    uint32_t channels;
+    uint32_t n_points;             // Max points per channel, 0 without SHM_FEED_POINTS
+    uint32_t n_bins;               // Spectrum values per channel, 0 without SHM_FEED_SPECTRUM
+    uint32_t n_slots;
+    uint32_t slot_size;
+    uint32_t frequencies_offset;
+    uint32_t slots_offset;
+    uint64_t latest;               // Atomic, last complete frame
+} shm_feed_header;
+
+typedef struct {
+    uint64_t sequence;             // Atomic, odd while being written, 2 * frame when complete
+    uint64_t time_ns;              // CLOCK_MONOTONIC
+} shm_feed_slot;
+
+typedef struct {
+    float min;                     // Limits the points are drawn with
+    float max;
+    uint32_t n_points;             // Used, up to n_points of the header
+    uint32_t reserved;
+} shm_feed_points;
+
+typedef struct shm_feed shm_feed;
+
+// Creates (or replaces) the shared memory object. frequencies has n_bins
+// values. Returns NULL (and prints why) on failure
+shm_feed* shm_feed_open(
+        const char* name,              // i.e. "term_pa_spectrum"
+        unsigned int flags,            // SHM_FEED_*
+        unsigned int channels,
+        unsigned int n_points,
+        unsigned int n_bins,
+        const double* frequencies
+        );
+
+// Unlinks the object, mapped readers keep their view
+void shm_feed_close(shm_feed* feed);
+
+// Points per channel of the layout, 0 without SHM_FEED_POINTS. Views
+// published here cannot have more
+unsigned int shm_feed_max_points(shm_feed* feed);
+
+// Writer side: fill what's published for every channel, then publish
+void shm_feed_write_points(shm_feed* feed, unsigned int channel, const real_t* points, unsigned int n_points, real_t min, real_t max);
+void shm_feed_write_spectrum(shm_feed* feed, unsigned int channel, const real_t* spectrum);
+void shm_feed_publish(shm_feed* feed);
+
+#endif
@@ -0,0 +1,108 @@
+/*
+   This file is part of the 'term_pa_spectrum' program, which follows
+   a pulseaudio stream and displays its frequency spectrum through the
+   terminal.
+
+   Copyright (C) <2018> Jose Maria Perez Ramos
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.    See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.    If not, see <http://www.gnu.org/licenses/>.
+
+   Author: Jose Maria Perez Ramos <jose.m.perez.ramos+git gmail>
+   Date: 2018.08.13
+   Version: 1.0.0
+*/
+
+#include "sliding_window.h"
+#include "fft.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+struct sliding_window {
+    real_t* buffer;                // 2 * n_samples per channel, second half mirrors the first one
+    unsigned int n_samples;        // Window length
+    unsigned int channels;         // Channel c starts at buffer + c * 2 * n_samples
+    unsigned int hop_samples;      // New samples between windows
+    unsigned int write_index;      // Position of the oldest sample, [0, n_samples)
+    unsigned int hop_remaining;    // Samples left to complete the current hop
+};
+
+sliding_window* sliding_window_init(unsigned int n_samples, unsigned int hop_samples, unsigned int channels) {
+    sliding_window* sw = NULL;
+    if ((sw = malloc(sizeof *sw))) {
+        if (!hop_samples || hop_samples > n_samples) {
+            hop_samples = n_samples;
+        }
+
+        *sw = (sliding_window) {
+            .buffer = FFTW(malloc)(channels * 2 * n_samples * sizeof *(sw->buffer)),
+            .n_samples = n_samples,
+            .channels = channels,
+            .hop_samples = hop_samples,
+        };
+        sliding_window_reset(sw);
+    }
+    return sw;
+}
+
+void sliding_window_deinit(sliding_window* sw) {
+    FFTW(free)(sw->buffer);
+    free(sw);
+}
+
+real_t* sliding_window_buffer(sliding_window* sw) {
+    return sw->buffer;
+}
+
+unsigned int sliding_window_channel_stride(sliding_window* sw) {
+    return 2 * sw->n_samples;
+}
+
+real_t* sliding_window_write_ptr(sliding_window* sw, unsigned int* available) {
+    unsigned int until_wrap = sw->n_samples - sw->write_index;
+    *available = (until_wrap < sw->hop_remaining) ? until_wrap : sw->hop_remaining;
+    return sw->buffer + sw->write_index;
+}
+
+const real_t* sliding_window_outgoing(sliding_window* sw) {
+    // The mirror of the write position is only updated on commit
+    return sw->buffer + sw->write_index + sw->n_samples;
+}
+
+real_t* sliding_window_commit(sliding_window* sw, unsigned int written) {
+    // Only the new samples are copied, to their mirror position
+    for (unsigned int channel = 0; channel < sw->channels; ++channel) {
+        real_t* new_samples = sw->buffer + channel * 2 * sw->n_samples + sw->write_index;
+        memcpy(new_samples + sw->n_samples, new_samples, written * sizeof *(sw->buffer));
+    }
+
+    sw->write_index += written;
+    if (sw->write_index == sw->n_samples) {
+        sw->write_index = 0;
+    }
+
+    sw->hop_remaining -= written;
+    if (sw->hop_remaining) {
+        return NULL;
+    }
+
+    sw->hop_remaining = sw->hop_samples;
+    return sw->buffer + sw->write_index; // Oldest sample first
+}
+
+void sliding_window_reset(sliding_window* sw) {
+    memset(sw->buffer, 0, sw->channels * 2 * sw->n_samples * sizeof *(sw->buffer));
+    sw->write_index = 0;
+    sw->hop_remaining = sw->hop_samples;
+}
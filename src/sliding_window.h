@@ -0,0 +1,41 @@
+#ifndef SLIDING_WINDOW_H
+#define SLIDING_WINDOW_H
+
+#include "precision.h"
+
+// Ring-buffered analysis window: the last n_samples samples are always
+// available as a contiguous array, and a new window is emitted every
+// hop_samples samples. Every sample is stored twice (at i and i+n_samples)
+// so that the window never has to be linearized.
+// With several channels, every channel has its own ring, all of them
+// sliding_window_channel_stride values apart: pointers returned for the
+// first channel are valid for channel c adding c * stride.
+
+typedef struct sliding_window sliding_window;
+
+sliding_window* sliding_window_init(unsigned int n_samples, unsigned int hop_samples, unsigned int channels);
+
+void sliding_window_deinit(sliding_window* sw);
+
+// Whole backing buffer (2*n_samples values per channel), e.g. to create a fftw plan
+real_t* sliding_window_buffer(sliding_window* sw);
+
+unsigned int sliding_window_channel_stride(sliding_window* sw);
+
+// Contiguous space where the next samples have to be written, and how many
+// of them can be written before calling sliding_window_commit
+real_t* sliding_window_write_ptr(sliding_window* sw, unsigned int* available);
+
+// Until the next commit, the samples that the ones at the write pointer are
+// replacing (n_samples older), same layout
+const real_t* sliding_window_outgoing(sliding_window* sw);
+
+// Marks as written that many samples (<= available), returns the window
+// (n_samples contiguous values, oldest first) if a hop has been completed,
+// NULL otherwise
+real_t* sliding_window_commit(sliding_window* sw, unsigned int written);
+
+// Forgets all the samples, next window will be emitted after a full hop
+void sliding_window_reset(sliding_window* sw);
+
+#endif
@@ -0,0 +1,141 @@
+/*
+   This file is part of the 'term_pa_spectrum' program, which follows
+   a pulseaudio stream and displays its frequency spectrum through the
+   terminal.
+
+   Copyright (C) <2018> Jose Maria Perez Ramos
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.    See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.    If not, see <http://www.gnu.org/licenses/>.
+
+   Author: Jose Maria Perez Ramos <jose.m.perez.ramos+git gmail>
+   Date: 2018.08.13
+   Version: 1.0.0
+*/
+
+#include "sparse_dft.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SPARSE_RESYNC_WINDOWS 64U // Full windows between Goertzel resyncs
+
+struct sparse_dft {
+    unsigned int n_samples;
+    unsigned int first_bin;
+    unsigned int n_bins;
+    double* re;                    // Bins, split so the update vectorizes across them
+    double* im;
+    double* twiddle_re;            // e^(j2πk/N)
+    double* twiddle_im;
+    double* delta;                 // new - old, per update
+    unsigned long since_resync;    // Samples
+};
+
+sparse_dft* sparse_dft_init(unsigned int n_samples, unsigned int first_bin, unsigned int last_bin) {
+    sparse_dft* sdft = NULL;
+    if ((sdft = malloc(sizeof *sdft))) {
+        unsigned int n_bins = last_bin - first_bin + 1;
+        *sdft = (sparse_dft) {
+            .n_samples = n_samples,
+            .first_bin = first_bin,
+            .n_bins = n_bins,
+            .re = calloc(n_bins, sizeof(double)),
+            .im = calloc(n_bins, sizeof(double)),
+            .twiddle_re = malloc(n_bins * sizeof(double)),
+            .twiddle_im = malloc(n_bins * sizeof(double)),
+            .delta = malloc(n_samples * sizeof(double)),
+        };
+        for (unsigned int b = 0; b < n_bins; ++b) {
+            double omega = 2 * M_PI * (first_bin + b) / n_samples;
+            sdft->twiddle_re[b] = cos(omega);
+            sdft->twiddle_im[b] = sin(omega);
+        }
+    }
+    return sdft;
+}
+
+void sparse_dft_deinit(sparse_dft* sdft) {
+    free(sdft->delta);
+    free(sdft->twiddle_im);
+    free(sdft->twiddle_re);
+    free(sdft->im);
+    free(sdft->re);
+    free(sdft);
+}
+
+int sparse_dft_is_cheaper(unsigned int n_samples, unsigned int hop_samples, unsigned int first_bin, unsigned int last_bin) {
+    // Rough flops: a complex add + mul per bin and sample, against a real
+    // FFT (~2.5 N log2 N) plus the magnitude of every bin
+    double sparse_cost = 6.0 * (last_bin - first_bin + 1) * hop_samples;
+    double fft_cost = 2.5 * n_samples * log2(n_samples) + 1.5 * n_samples;
+    return sparse_cost < fft_cost;
+}
+
+void sparse_dft_update(sparse_dft* sdft, const real_t* new_samples, const real_t* old_samples, unsigned int length) {
+    double* restrict re = sdft->re;
+    double* restrict im = sdft->im;
+    const double* restrict twiddle_re = sdft->twiddle_re;
+    const double* restrict twiddle_im = sdft->twiddle_im;
+    double* delta = sdft->delta;
+    unsigned int n_bins = sdft->n_bins;
+
+    for (unsigned int i = 0; i < length; ++i) {
+        delta[i] = (double) new_samples[i] - old_samples[i];
+    }
+
+    for (unsigned int i = 0; i < length; ++i) {
+        double d = delta[i];
+        for (unsigned int b = 0; b < n_bins; ++b) {
+            double r = re[b] + d;
+            double m = im[b];
+            re[b] = r * twiddle_re[b] - m * twiddle_im[b];
+            im[b] = r * twiddle_im[b] + m * twiddle_re[b];
+        }
+    }
+    sdft->since_resync += length;
+}
+
+// Goertzel, X = cos(ω) s1 - s2 + j sin(ω) s1 after the whole window
+static void resync(sparse_dft* sdft, const real_t* window) {
+    for (unsigned int b = 0; b < sdft->n_bins; ++b) {
+        double coefficient = 2 * sdft->twiddle_re[b];
+        double s1 = 0, s2 = 0;
+        for (unsigned int i = 0; i < sdft->n_samples; ++i) {
+            double s0 = window[i] + coefficient * s1 - s2;
+            s2 = s1;
+            s1 = s0;
+        }
+        sdft->re[b] = sdft->twiddle_re[b] * s1 - s2;
+        sdft->im[b] = sdft->twiddle_im[b] * s1;
+    }
+    sdft->since_resync = 0;
+}
+
+void sparse_dft_magnitude(sparse_dft* sdft, const real_t* window, real_t* out, real_t scale) {
+    if (sdft->since_resync >= (unsigned long) SPARSE_RESYNC_WINDOWS * sdft->n_samples) {
+        resync(sdft, window);
+    }
+
+    out += sdft->first_bin;
+    for (unsigned int b = 0; b < sdft->n_bins; ++b) {
+        out[b] = scale * sqrt(sdft->re[b] * sdft->re[b] + sdft->im[b] * sdft->im[b]);
+    }
+}
+
+void sparse_dft_reset(sparse_dft* sdft) {
+    memset(sdft->re, 0, sdft->n_bins * sizeof(double));
+    memset(sdft->im, 0, sdft->n_bins * sizeof(double));
+    sdft->since_resync = 0;
+}
@@ -0,0 +1,31 @@
+#ifndef SPARSE_DFT_H
+#define SPARSE_DFT_H
+
+#include "precision.h"
+
+// Sliding DFT of a few consecutive bins: every new sample updates them
+// (X = (X + new - old) * e^(j2πk/N)), so the spectrum is current after each
+// sample and the cost only depends on how many bins are displayed.
+// Bins are kept in double precision and recomputed from the window with
+// Goertzel from time to time, so the recurrence can't drift
+
+typedef struct sparse_dft sparse_dft;
+
+sparse_dft* sparse_dft_init(unsigned int n_samples, unsigned int first_bin, unsigned int last_bin);
+
+void sparse_dft_deinit(sparse_dft* sdft);
+
+// Whether updating the bins sample by sample is cheaper than one FFT per hop
+int sparse_dft_is_cheaper(unsigned int n_samples, unsigned int hop_samples, unsigned int first_bin, unsigned int last_bin);
+
+// new_samples replace old_samples (n_samples older) in the window
+void sparse_dft_update(sparse_dft* sdft, const real_t* new_samples, const real_t* old_samples, unsigned int length);
+
+// Writes the magnitude of the bins to out[first_bin..last_bin], like
+// fft_magnitude. window (oldest sample first) is used to resync
+void sparse_dft_magnitude(sparse_dft* sdft, const real_t* window, real_t* out, real_t scale);
+
+// The window is all zeros again
+void sparse_dft_reset(sparse_dft* sdft);
+
+#endif
@@ -0,0 +1,168 @@
+/*
+   This file is part of the 'term_pa_spectrum' program, which follows
+   a pulseaudio stream and displays its frequency spectrum through the
+   terminal.
+
+   Copyright (C) <2018> Jose Maria Perez Ramos
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.    See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.    If not, see <http://www.gnu.org/licenses/>.
+
+   Author: Jose Maria Perez Ramos <jose.m.perez.ramos+git gmail>
+   Date: 2018.08.13
+   Version: 1.0.0
+*/
+
+#include "spsc_ring.h"
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <unistd.h>
+
+struct spsc_ring {
+    // Positions grow forever, offset in buffer is position % capacity
+    _Alignas(64) atomic_size_t write_pos;    // Only written by the producer
+    _Alignas(64) atomic_size_t read_pos;     // Only written by the consumer
+    _Alignas(64) atomic_size_t dropped;
+    atomic_int closed;
+    atomic_uint_least64_t push_ns;
+
+    int timestamps;
+
+    size_t capacity;
+    size_t frame_size;
+    int event_fd;
+    unsigned char* buffer;
+};
+
+spsc_ring* spsc_ring_init(size_t n_frames, size_t frame_size) {
+    spsc_ring* ring = NULL;
+    if ((ring = aligned_alloc(64, (sizeof *ring + 63) / 64 * 64))) {
+        memset(ring, 0, sizeof *ring);
+        ring->capacity = n_frames * frame_size;
+        ring->frame_size = frame_size;
+        ring->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        ring->buffer = malloc(ring->capacity);
+        atomic_init(&ring->write_pos, 0);
+        atomic_init(&ring->read_pos, 0);
+        atomic_init(&ring->dropped, 0);
+        atomic_init(&ring->closed, 0);
+        atomic_init(&ring->push_ns, 0);
+    }
+    return ring;
+}
+
+void spsc_ring_deinit(spsc_ring* ring) {
+    close(ring->event_fd);
+    free(ring->buffer);
+    free(ring);
+}
+
+static void notify(spsc_ring* ring) {
+    uint64_t one = 1;
+    // Nonblocking: if the counter is saturated the consumer is already awake
+    if (write(ring->event_fd, &one, sizeof one) < 0) {
+        return;
+    }
+}
+
+size_t spsc_ring_push(spsc_ring* ring, const void* data, size_t length) {
+    size_t write_pos = atomic_load_explicit(&ring->write_pos, memory_order_relaxed);
+    size_t read_pos = atomic_load_explicit(&ring->read_pos, memory_order_acquire);
+    size_t free_bytes = ring->capacity - (write_pos - read_pos);
+
+    length -= length % ring->frame_size;
+    size_t to_push = (length < free_bytes) ? length : free_bytes;
+    if (to_push < length) {
+        atomic_fetch_add_explicit(&ring->dropped, length - to_push, memory_order_relaxed);
+    }
+
+    size_t offset = write_pos % ring->capacity;
+    size_t first = ring->capacity - offset;
+    if (first > to_push) {
+        first = to_push;
+    }
+    memcpy(ring->buffer + offset, data, first);
+    memcpy(ring->buffer, (const unsigned char*) data + first, to_push - first);
+
+    if (ring->timestamps && to_push) {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        // Released along with the data by the write_pos store
+        atomic_store_explicit(&ring->push_ns, (uint64_t) ts.tv_sec * 1000000000U + ts.tv_nsec, memory_order_relaxed);
+    }
+    atomic_store_explicit(&ring->write_pos, write_pos + to_push, memory_order_release);
+    if (to_push) {
+        notify(ring);
+    }
+    return to_push;
+}
+
+void spsc_ring_close(spsc_ring* ring) {
+    atomic_store_explicit(&ring->closed, 1, memory_order_release);
+    notify(ring);
+}
+
+int spsc_ring_fd(spsc_ring* ring) {
+    return ring->event_fd;
+}
+
+void spsc_ring_clear_fd(spsc_ring* ring) {
+    uint64_t count;
+    if (read(ring->event_fd, &count, sizeof count) < 0) {
+        return; // EAGAIN, nothing pending
+    }
+}
+
+const void* spsc_ring_peek(spsc_ring* ring, size_t* length) {
+    size_t read_pos = atomic_load_explicit(&ring->read_pos, memory_order_relaxed);
+    size_t write_pos = atomic_load_explicit(&ring->write_pos, memory_order_acquire);
+    size_t offset = read_pos % ring->capacity;
+    size_t available = write_pos - read_pos;
+
+    *length = (available < ring->capacity - offset) ? available : ring->capacity - offset;
+    return ring->buffer + offset;
+}
+
+void spsc_ring_consume(spsc_ring* ring, size_t length) {
+    size_t read_pos = atomic_load_explicit(&ring->read_pos, memory_order_relaxed);
+    atomic_store_explicit(&ring->read_pos, read_pos + length, memory_order_release);
+}
+
+void spsc_ring_discard(spsc_ring* ring) {
+    size_t write_pos = atomic_load_explicit(&ring->write_pos, memory_order_acquire);
+    atomic_store_explicit(&ring->read_pos, write_pos, memory_order_release);
+}
+
+int spsc_ring_closed(spsc_ring* ring) {
+    return atomic_load_explicit(&ring->closed, memory_order_acquire);
+}
+
+size_t spsc_ring_dropped(spsc_ring* ring) {
+    return atomic_load_explicit(&ring->dropped, memory_order_relaxed);
+}
+
+void spsc_ring_set_timestamps(spsc_ring* ring, int enabled) {
+    ring->timestamps = enabled;
+}
+
+uint64_t spsc_ring_push_time(spsc_ring* ring) {
+    // Acquired like in peek, so the time is at least that of the data
+    // released with this write_pos, never an older one
+    atomic_load_explicit(&ring->write_pos, memory_order_acquire);
+    return atomic_load_explicit(&ring->push_ns, memory_order_relaxed);
+}
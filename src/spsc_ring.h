@@ -0,0 +1,37 @@
+#ifndef SPSC_RING_H
+#define SPSC_RING_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Lock-free single producer / single consumer byte ring.
+// The producer never blocks: whatever does not fit is dropped (and counted).
+// The consumer can wait for data on a file descriptor (eventfd).
+// Both the capacity and every push are whole frames, so a frame is never
+// split by the end of the buffer.
+
+typedef struct spsc_ring spsc_ring;
+
+spsc_ring* spsc_ring_init(size_t n_frames, size_t frame_size);
+
+void spsc_ring_deinit(spsc_ring* ring);
+
+// Producer side
+size_t spsc_ring_push(spsc_ring* ring, const void* data, size_t length);
+void spsc_ring_close(spsc_ring* ring);
+
+// Consumer side
+int spsc_ring_fd(spsc_ring* ring); // Readable when data was pushed or the ring was closed
+void spsc_ring_clear_fd(spsc_ring* ring);
+const void* spsc_ring_peek(spsc_ring* ring, size_t* length); // Contiguous readable bytes
+void spsc_ring_consume(spsc_ring* ring, size_t length);
+void spsc_ring_discard(spsc_ring* ring); // Consume everything available
+int spsc_ring_closed(spsc_ring* ring);
+size_t spsc_ring_dropped(spsc_ring* ring); // Bytes that did not fit
+
+// Off by default. When enabled, every push stores its CLOCK_MONOTONIC time
+// (ns), visible to the consumer along with the pushed data
+void spsc_ring_set_timestamps(spsc_ring* ring, int enabled);
+uint64_t spsc_ring_push_time(spsc_ring* ring); // Of the last push visible to the next peek or a later one, 0 if none
+
+#endif
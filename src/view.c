@@ -0,0 +1,341 @@
+/*
+   This file is part of the 'term_pa_spectrum' program, which follows
+   a pulseaudio stream and displays its frequency spectrum through the
+   terminal.
+
+   Copyright (C) <2018> Jose Maria Perez Ramos
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.    See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.    If not, see <http://www.gnu.org/licenses/>.
+
+   Author: Jose Maria Perez Ramos <jose.m.perez.ramos+git gmail>
+   Date: 2018.08.13
+   Version: 1.0.0
+*/
+
+#include "view.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Options //////
+typedef struct {const char* s; int v;} view_name;
+static const view_name charset_names[] = {
+    {.s = "bars",         .v = OUTPUT_CHARSET_BARS},
+    {.s = "braille",      .v = OUTPUT_CHARSET_BRAILLE},
+    {.s = "wide_braille", .v = OUTPUT_CHARSET_BRAILLE_WIDE},
+    {.s = NULL},
+};
+static const view_name grouping_names[] = {
+    {.s = "none",   .v = OUTPUT_NO_GROUPING},
+    {.s = "lineal", .v = OUTPUT_LINEAL_GROUPING},
+    {.s = "log",    .v = OUTPUT_LOGARITMIC_GROUPING},
+    {.s = NULL},
+};
+static const view_name groupingfunc_names[] = {
+    {.s = "none", .v = OUTPUT_NO_GROUPING_FUNC},
+    {.s = "max",  .v = OUTPUT_MAX_GROUPING_FUNC},
+    {.s = "avg",  .v = OUTPUT_AVG_GROUPING_FUNC},
+    {.s = NULL},
+};
+static const view_name smoothing_names[] = {
+    {.s = "none", .v = OUTPUT_NO_SMOOTH},
+    {.s = "exp2", .v = OUTPUT_EXP2_SMOOTH},
+    {.s = NULL},
+};
+
+static int name_to_value(const view_name* names, const char* s, int* value) {
+    for (; names->s; ++names) {
+        if (strcmp(names->s, s) == 0) {
+            *value = names->v;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static const char* value_to_name(const view_name* names, int v) {
+    for (; names->s; ++names) {
+        if (names->v == v) {
+            return names->s;
+        }
+    }
+    return "none";
+}
+
+static int parse_uint(const char* s, unsigned int* value) {
+    char* end;
+    long v = strtol(s, &end, 10);
+    if (end == s || *end || v <= 0 || v > 0x7FFFFFFF) {
+        return -1;
+    }
+    *value = v;
+    return 0;
+}
+
+static int parse_double(const char* s, double* value, double min) {
+    char* end;
+    double v = strtod(s, &end);
+    if (end == s || *end || !(v >= min) || v > 1e9) {
+        return -1;
+    }
+    *value = v;
+    return 0;
+}
+
+void view_config_defaults(view_config* config) {
+    *config = (view_config) {
+        .num_points = 30,
+        .start_freq = 200,
+        .end_freq = 2000, // Not 4k because with low freq spikes it's difficult to see high freq ones
+        .charset = OUTPUT_CHARSET_BARS,
+        .grouping = OUTPUT_NO_GROUPING,
+        .group_func = OUTPUT_MAX_GROUPING_FUNC,
+        .smoothing = OUTPUT_EXP2_SMOOTH,
+        .lineal_scaling_factor_offset = .8,
+        .sigmoid_scaling_factor = 0,
+        .smooth_value_factor = .25,
+        .smooth_limit_factor = .2,
+    };
+}
+
+int view_config_set(view_config* config, char option, const char* value) {
+    if (!value) {
+        return -1;
+    }
+    switch (option) {
+        case 'b': return parse_uint(value, &config->num_points);
+        case 'f': return parse_uint(value, &config->start_freq);
+        case 'F': return parse_uint(value, &config->end_freq);
+        case 'c': return name_to_value(charset_names, value, &config->charset);
+        case 'g': return name_to_value(grouping_names, value, &config->grouping);
+        case 'G': return name_to_value(groupingfunc_names, value, &config->group_func);
+        case 'm': return name_to_value(smoothing_names, value, &config->smoothing);
+        case 'o': {
+            double offset;
+            if (parse_double(value, &offset, 0) || offset == 0) {
+                return -1;
+            }
+            config->lineal_scaling_factor_offset = offset;
+            return 0;
+        }
+        case 'i': return parse_double(value, &config->sigmoid_scaling_factor, 0);
+    }
+    return -1;
+}
+
+int view_config_parse(view_config* config, const char* options) {
+    char* copy = strdup(options);
+    if (!copy) {
+        return '-';
+    }
+
+    view_config parsed = *config;
+    int invalid = 0;
+    char* saveptr;
+    const char* separators = " \t\r\n";
+    for (char* option = strtok_r(copy, separators, &saveptr); option && !invalid; option = strtok_r(NULL, separators, &saveptr)) {
+        if (option[0] != '-' || !option[1] || option[2]) {
+            invalid = '-';
+        } else if (view_config_set(&parsed, option[1], strtok_r(NULL, separators, &saveptr))) {
+            invalid = option[1];
+        }
+    }
+    free(copy);
+
+    if (!invalid) {
+        *config = parsed;
+    }
+    return invalid;
+}
+
+int view_config_format(const view_config* config, char* buffer, size_t size) {
+    // %.17g so the values are parsed back exactly
+    return snprintf(buffer, size, "-b %u -f %u -F %u -c %s -g %s -G %s -m %s -o %.17g -i %.17g",
+            config->num_points, config->start_freq, config->end_freq,
+            value_to_name(charset_names, config->charset),
+            value_to_name(grouping_names, config->grouping),
+            value_to_name(groupingfunc_names, config->group_func),
+            value_to_name(smoothing_names, config->smoothing),
+            config->lineal_scaling_factor_offset, config->sigmoid_scaling_factor);
+}
+
+// Field by field, the padding may differ
+int view_config_equal(const view_config* a, const view_config* b) {
+    return a->num_points == b->num_points
+        && a->start_freq == b->start_freq
+        && a->end_freq == b->end_freq
+        && a->charset == b->charset
+        && a->grouping == b->grouping
+        && a->group_func == b->group_func
+        && a->smoothing == b->smoothing
+        && a->lineal_scaling_factor_offset == b->lineal_scaling_factor_offset
+        && a->sigmoid_scaling_factor == b->sigmoid_scaling_factor
+        && a->smooth_value_factor == b->smooth_value_factor
+        && a->smooth_limit_factor == b->smooth_limit_factor;
+}
+/////////////////
+
+struct view {
+    view_config config;
+    unsigned int channels;
+    output_context** out_ctxs;
+    size_t line_max_length;
+};
+
+view* view_init(const view_config* config, unsigned int data_length, const double* data_frequency, unsigned int channels, unsigned int transform_flags) {
+    view* v = (view*) malloc(sizeof(view));
+    if (!v) {
+        return NULL;
+    }
+    v->config = *config;
+    v->channels = 0; // Contexts created so far
+    v->out_ctxs = (output_context**) malloc(sizeof(output_context*) * channels);
+    v->line_max_length = channels - 1; // Separators
+    if (!v->out_ctxs) {
+        free(v);
+        return NULL;
+    }
+
+    for (unsigned int c = 0; c < channels; ++c) {
+        output_context* out_ctx = output_init(
+                data_length,          // unsigned int data_length,
+                data_frequency,       // const double* data_frequency,
+                config->start_freq,   // unsigned int min_freq,
+                config->end_freq,     // unsigned int max_freq,
+                config->num_points,   // unsigned int num_points,
+                0,                    // double abs_min,
+                100000000,            // double abs_max,
+                config->grouping,     // int grouping,
+                config->group_func,   // int group_func,
+                transform_flags       // int transform flags
+                );
+        if (!out_ctx) {
+            view_deinit(v);
+            return NULL;
+        }
+        output_set_silence_str(out_ctx, c ? "" : "No \u266C "); // No ♬ */
+        output_set_smoothing(out_ctx, config->smoothing);
+        output_set_smoothing_factors(out_ctx, config->smooth_value_factor, config->smooth_limit_factor);
+        output_set_lineal_scale_factor_offset(out_ctx, config->lineal_scaling_factor_offset);
+        if (config->sigmoid_scaling_factor > 0) {
+            output_set_sigmoid_scale_factor(out_ctx, config->sigmoid_scaling_factor);
+        }
+        output_set_charset(out_ctx, config->charset);
+        output_set_mirrored(out_ctx, channels == 2 && c == 0); // Bass in the middle
+        v->line_max_length += output_line_max_length(out_ctx);
+        v->out_ctxs[c] = out_ctx;
+        v->channels++;
+    }
+
+    return v;
+}
+
+int view_reconfigure(view* v, const view_config* config) {
+    const view_config* old = &v->config;
+    int regroup = config->num_points != old->num_points
+        || config->start_freq != old->start_freq
+        || config->end_freq != old->end_freq
+        || config->grouping != old->grouping
+        || config->group_func != old->group_func;
+    int smoothing = config->smoothing != old->smoothing
+        || config->smooth_value_factor != old->smooth_value_factor
+        || config->smooth_limit_factor != old->smooth_limit_factor;
+
+    if (regroup) {
+        for (unsigned int c = 0; c < v->channels; ++c) {
+            if (output_set_grouping(v->out_ctxs[c], config->start_freq, config->end_freq, config->num_points, config->grouping, config->group_func)) {
+                // The previous grouping needs no more room
+                while (c--) {
+                    output_set_grouping(v->out_ctxs[c], old->start_freq, old->end_freq, old->num_points, old->grouping, old->group_func);
+                }
+                return -1;
+            }
+        }
+    }
+
+    v->line_max_length = v->channels - 1;
+    for (unsigned int c = 0; c < v->channels; ++c) {
+        output_context* out_ctx = v->out_ctxs[c];
+        if (smoothing) {
+            output_set_smoothing(out_ctx, config->smoothing);
+            output_set_smoothing_factors(out_ctx, config->smooth_value_factor, config->smooth_limit_factor);
+        }
+        if (config->lineal_scaling_factor_offset != old->lineal_scaling_factor_offset) {
+            output_set_lineal_scale_factor_offset(out_ctx, config->lineal_scaling_factor_offset);
+        }
+        if (config->sigmoid_scaling_factor != old->sigmoid_scaling_factor) {
+            output_set_sigmoid_scale_factor(out_ctx, config->sigmoid_scaling_factor);
+        }
+        if (config->charset != old->charset) {
+            output_set_charset(out_ctx, config->charset);
+        }
+        v->line_max_length += output_line_max_length(out_ctx);
+    }
+    v->config = *config;
+    return 0;
+}
+
+const view_config* view_get_config(view* v) {
+    return &v->config;
+}
+
+void view_deinit(view* v) {
+    for (unsigned int c = 0; c < v->channels; ++c) {
+        output_deinit(v->out_ctxs[c]);
+    }
+    free(v->out_ctxs);
+    free(v);
+}
+
+void view_set_log_input(view* v, int log_input) {
+    for (unsigned int c = 0; c < v->channels; ++c) {
+        output_set_log_input(v->out_ctxs[c], log_input);
+    }
+}
+
+void view_data_range(view* v, unsigned int* min_data_index, unsigned int* max_data_index) {
+    output_data_range(v->out_ctxs[0], min_data_index, max_data_index); // Same for every channel
+}
+
+output_context* view_output(view* v, unsigned int channel) {
+    return v->out_ctxs[channel];
+}
+
+size_t view_line_max_length(view* v) {
+    return v->line_max_length;
+}
+
+unsigned int view_points_for_width(view* v, unsigned int width) {
+    unsigned int separators = (v->channels > 2) ? v->channels - 1 : 0;
+    unsigned int chars = (width > separators) ? (width - separators) / v->channels : 0;
+    return (chars ? chars : 1) * output_points_per_char(v->out_ctxs[0]);
+}
+
+void view_update(view* v, real_t* data, unsigned int channel_distance) {
+    for (unsigned int c = 0; c < v->channels; ++c) {
+        output_update(v->out_ctxs[c], data + c * channel_distance);
+    }
+}
+
+size_t view_render(view* v, char* buffer, int silence) {
+    size_t length = 0;
+    for (unsigned int c = 0; c < v->channels; ++c) {
+        if (c && v->channels > 2) {
+            buffer[length++] = ' ';
+        }
+        length += silence ? output_print_silence(v->out_ctxs[c], buffer + length) : output_render(v->out_ctxs[c], buffer + length);
+    }
+    return length;
+}
@@ -0,0 +1,84 @@
+#ifndef VIEW_H
+#define VIEW_H
+
+#include "output.h"
+#include "precision.h"
+
+#include <stddef.h>
+
+// How the spectrum is displayed: the output options of the command line,
+// but the transform (-t), which applies to the whole spectrum
+typedef struct {
+    unsigned int num_points;               // b
+    unsigned int start_freq;               // f
+    unsigned int end_freq;                 // F
+    int charset;                           // c
+    int grouping;                          // g
+    int group_func;                        // G
+    int smoothing;                         // m
+    double lineal_scaling_factor_offset;   // o
+    double sigmoid_scaling_factor;         // i, 0 is disabled
+    double smooth_value_factor;
+    double smooth_limit_factor;
+} view_config;
+
+void view_config_defaults(view_config* config);
+
+// Sets an option from its command line letter and value. Returns 0, or -1
+// if it's invalid (the config is not modified)
+int view_config_set(view_config* config, char option, const char* value);
+
+// Whitespace separated options, as in the command line (i.e. "-b 40 -c
+// braille"), over the current values. Returns 0, or the letter of the first
+// invalid or unknown option ('-' if it's not an option at all)
+int view_config_parse(view_config* config, const char* options);
+
+// Every option, in view_config_parse format. Returns as snprintf
+int view_config_format(const view_config* config, char* buffer, size_t size);
+
+int view_config_equal(const view_config* a, const view_config* b);
+
+
+// One output context per channel, drawn side by side in a line (stereo is
+// mirrored, bass in the middle)
+typedef struct view view;
+
+view* view_init(
+        const view_config* config,
+        unsigned int data_length,
+        const double* data_frequency,  // Copied
+        unsigned int channels,
+        unsigned int transform_flags
+        );   // NULL if it cannot be allocated
+
+void view_deinit(view* v);
+
+// Applies the options that differ from the current ones, between frames:
+// the capture and the spectrum are untouched, a new range or number of
+// columns only rebuilds the grouping tables (see output_set_grouping). The
+// data range and view_line_max_length may change. Returns -1, with the view
+// unchanged, if it does not fit in memory
+int view_reconfigure(view* v, const view_config* config);
+
+const view_config* view_get_config(view* v);
+
+// See output_set_log_input
+void view_set_log_input(view* v, int log_input);
+
+// Displayed data indexes, min > max if none
+void view_data_range(view* v, unsigned int* min_data_index, unsigned int* max_data_index);
+
+output_context* view_output(view* v, unsigned int channel);
+
+size_t view_line_max_length(view* v);
+
+// Columns (-b) that fill a line of that many chars, at least one per channel
+unsigned int view_points_for_width(view* v, unsigned int width);
+
+// Channel c data starts at data + c * channel_distance
+void view_update(view* v, real_t* data, unsigned int channel_distance);
+
+// Returns the length of the line, not null terminated
+size_t view_render(view* v, char* buffer, int silence);
+
+#endif